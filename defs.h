@@ -16,6 +16,7 @@
 
 #define MAILESTD_CONF_PATH		"mailestd.conf"
 #define MAILESTD_LOG_PATH		"mailestd.log"
+#define MAILESTD_FAILED_PATH		"mailestd.failed"
 #define MAILESTD_LOGSIZ			(30 * 1024)
 #define MAILESTD_LOGROTMAX		8
 #define MAILESTD_LOGROTWHEN		(60 * 60)	/* hourly */
@@ -23,10 +24,42 @@
 #define MAILESTD_DBNAME			"casket"
 #define MAILESTD_TRIMSIZE		(128 * 1024)
 #define MAILESTD_DBFLUSHSIZ		1024
+#define MAILESTD_DBLOCK_HOLD		1000	/* millisec, searches wait */
+#define MAILESTD_DBDIRTYSIZ		(32 * 1024 * 1024)
+#define MAILESTD_DBIDLE			60	/* sec, to close the db */
+#define MAILESTD_DBIOBUDGET		250	/* millisec per sec, maintenance */
+#define MAILESTD_DBMAINTSLICE		100	/* millisec, a step of flushing */
+#define MAILESTD_DBFRAGRATIO		10	/* % flushed to optimize */
+#define MAILESTD_DBPURGERATIO		5	/* % of docs deleted to purge */
+#define MAILESTD_DBPURGEMIN		256
+#define MAILESTD_DBMETA_GARBAGE		"mailestd-garbage"
+#define MAILESTD_DBBULKCACHESIZ		(256 * 1024 * 1024)	/* bulk load */
+#define MAILESTD_REBUILD_MAXTHREADS	16
+#define MAILESTD_REBUILD_DIR		"rebuild"	/* in the db path */
+#define MAILESTD_SEARCH_NTHREADS	2
 #define MAILESTD_DEFAULT_SUFFIX		".mew"
 #define MAILESTD_DEFAULT_FOLDERS	"!trash", "!casket", "!casket_replica"
 #define MAILESTD_DBSYNC_NITER		4000
+#define MAILESTD_GATHER_NITER		4000
+#define MAILESTD_DRAFTCACHE_SIZ		(16 * 1024 * 1024)
+#define MAILESTD_WALK_NTHREADS		4
+#define MAILESTD_WALK_PARALLEL		256	/* entries to use threads */
+#define MAILESTD_INODEORDER_WINDOW	1024	/* drafts to be reordered */
+#define MAILESTD_MBOX_READSIZ		(64 * 1024)
 #define	MAILESTD_MONITOR_DELAY		1500
+#define	MAILESTD_MONITOR_MAXDELAY	30000
+#define	MAILESTD_MONITOR_POLLMIN	10	/* sec, polling unwatched ones */
+#define	MAILESTD_MONITOR_POLLMAX	600
+#define	MAILESTD_MONITOR_COLD		600	/* sec, to give up the watch */
+#define	MAILESTD_MONITOR_POLLRATE	100	/* polls per second */
+#define	MAILESTD_MONITOR_INBUFSIZ	(64 * 1024)	/* inotify events */
+#define	MAILESTD_MONITOR_MOVEWAIT	100	/* msec, for IN_MOVED_TO */
+
+struct mailestd_conf_monitor {
+	char	 *folder;		/* pattern */
+	long	  max_delay;		/* millisec, -1 for the default */
+	int	  poll;			/* poll instead of watching */
+};
 
 struct mailestd_conf {
 	int	  debug;
@@ -36,11 +69,23 @@ struct mailestd_conf {
 	int	  log_count;
 	int	  trim_size;
 	char	 *db_path;
+	int	  db_io_budget;		/* millisec per second */
 	int	  tasks;
 	char	 *maildir;
 	char	**suffixes;
+	char	**mbox_suffixes;
 	char	**folders;
 	int	  monitor;
 	long	  monitor_delay;	/* millisec */
+	long	  monitor_max_delay;	/* millisec */
+	struct mailestd_conf_monitor
+		 *monitor_folders;
+	int	  nmonitor_folders;
+	int	  monitor_watches;
+	int	  monitor_poll_rate;
 	int	  paridguess;
+	int	  headersfirst;
+	int	  contenthash;
+	int	  inodeorder;
+	int	  maildirformat;
 };
@@ -25,6 +25,7 @@
 #include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -46,6 +47,7 @@ static bool		 mailestc_check_connection(void);
 size_t			 ic_strlcpy(char *, const char *, size_t, const char *);
 static void		 run_daemon(const char *, char *[]);
 static void		 stop_daemon(void);
+static void		 update_files(FILE *);
 
 static void
 usage(void)
@@ -181,6 +183,11 @@ do_common:
 		goto wait_resp;
 		break;
 
+	case UPDATE_FILES:
+		run_daemon(cmd, cmdv);
+		update_files(stdin);
+		goto wait_resp;
+
 	case CSEARCH:
 		run_daemon(cmd, cmdv);
 		memset(&search, 0, sizeof(search));
@@ -268,6 +275,26 @@ wait_resp:
 		wait_resp = true;
 		goto do_common;
 
+	case FAILED:
+		ctl.command = MAILESTCTL_CMD_FAILED;
+		wait_resp = true;
+		goto do_common;
+
+	case FAILED_CLEAR:
+		ctl.command = MAILESTCTL_CMD_FAILED_CLEAR;
+		wait_resp = true;
+		goto do_common;
+
+	case REBUILD:
+		ctl.command = MAILESTCTL_CMD_REBUILD;
+		wait_resp = true;
+		goto do_common;
+
+	case STATS:
+		ctl.command = MAILESTCTL_CMD_STATS;
+		wait_resp = true;
+		goto do_common;
+
 	case NONE:
 		break;
 	}
@@ -348,6 +375,57 @@ stop_daemon(void)
 		warnx("cannot stop mailestd");
 }
 
+/*
+ * Send the paths read from the file, one per line.  The relative paths
+ * other than "+folder/..." are made absolute with the current directory.
+ */
+static void
+update_files(FILE *fp)
+{
+	char				*line = NULL, cwd[PATH_MAX],
+					 path[PATH_MAX];
+	size_t				 linesiz = 0, lpath, off = 0;
+	ssize_t				 len;
+	struct mailestctl_update_files	 files;
+
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+		err(1, "getcwd");
+	memset(&files, 0, sizeof(files));
+	files.command = MAILESTCTL_CMD_UPDATE_FILES;
+	while ((len = getline(&line, &linesiz, fp)) != -1) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+		if (line[0] == '/' || line[0] == '+')
+			lpath = strlcpy(path, line, sizeof(path));
+		else
+			lpath = snprintf(path, sizeof(path), "%s/%s", cwd,
+			    line);
+		if (lpath >= sizeof(path)) {
+			warnx("%s: path too long", line);
+			continue;
+		}
+		if (off + lpath + 1 > sizeof(files.paths)) {
+			files.more = 1;
+			if (write(mailestc_sock, &files,
+			    offsetof(struct mailestctl_update_files, paths) +
+			    off) < 0)
+				err(1, "write");
+			off = 0;
+		}
+		memcpy(files.paths + off, path, lpath + 1);
+		off += lpath + 1;
+	}
+	if (ferror(fp))
+		err(1, "getline");
+	free(line);
+	files.more = 0;
+	if (write(mailestc_sock, &files,
+	    offsetof(struct mailestctl_update_files, paths) + off) < 0)
+		err(1, "write");
+}
+
 size_t
 ic_strlcpy(char *output, const char *input, size_t output_siz,
     const char *input_encoding)
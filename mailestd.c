@@ -37,7 +37,6 @@
 #include <event.h>
 #include <fcntl.h>
 #include <fnmatch.h>
-#include <fts.h>
 #include <glob.h>
 #include <libgen.h>
 #include <limits.h>
@@ -45,6 +44,7 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -214,7 +214,10 @@ mailestd_init(struct mailestd *_this, struct mailestd_conf *conf,
 	if (debug == 0)
 		debug = conf->debug;
 	RB_INIT(&_this->root);
+	RB_INIT(&_this->dircache);
+	RB_INIT(&_this->draft_cache);
 	TAILQ_INIT(&_this->rfc822_pendings);
+	TAILQ_INIT(&_this->rfc822_bodies);
 	TAILQ_INIT(&_this->gather_pendings);
 	TAILQ_INIT(&_this->rfc822_tasks);
 	_this->rfc822_task_max = conf->tasks;
@@ -222,9 +225,12 @@ mailestd_init(struct mailestd *_this, struct mailestd_conf *conf,
 	TAILQ_INIT(&_this->gathers);
 	strlcpy(_this->logfn, conf->log_path, sizeof(_this->logfn));
 	strlcpy(_this->dbpath, conf->db_path, sizeof(_this->dbpath));
+	snprintf(_this->failedfn, sizeof(_this->failedfn), "%s/%s",
+	    _this->maildir, MAILESTD_FAILED_PATH);
 	_this->logsiz = conf->log_size;
 	_this->logmax = conf->log_count;
 	_this->doc_trimsize = conf->trim_size;
+	_this->db_io_budget = conf->db_io_budget;
 	if (conf->folders == NULL) {
 		_this->folder = xcalloc(nitems(deffolder) + 1, sizeof(char *));
 		for (i = 0; i < (int)nitems(deffolder); i++)
@@ -237,7 +243,20 @@ mailestd_init(struct mailestd *_this, struct mailestd_conf *conf,
 	_this->monitor = conf->monitor;
 	_this->monitor_delay.tv_sec = conf->monitor_delay / 1000;
 	_this->monitor_delay.tv_nsec = (conf->monitor_delay % 1000) * 1000000UL;
+	_this->monitor_max_delay = conf->monitor_max_delay;
+	_this->monitor_watches = conf->monitor_watches;
+	_this->monitor_poll_rate = conf->monitor_poll_rate;
+	_this->monitor_folders = conf->monitor_folders;
+	_this->nmonitor_folders = conf->nmonitor_folders;
+	conf->monitor_folders = NULL;
+	conf->nmonitor_folders = 0;
 	_this->paridguess = (conf->paridguess)? true : false;
+	_this->inodeorder = (conf->inodeorder)? true : false;
+	_this->maildirformat = (conf->maildirformat)? true : false;
+#ifdef HAVE_LIBESTDRAFT
+	_this->headersfirst = (conf->headersfirst)? true : false;
+	_this->contenthash = (conf->contenthash)? true : false;
+#endif
 
 	for (i = 0; suffix != NULL && !isnull(suffix[i]); i++)
 		/* nothing */;
@@ -258,8 +277,14 @@ mailestd_init(struct mailestd *_this, struct mailestd_conf *conf,
 			_this->suffix[ns++] = xstrdup(conf->suffixes[i]);
 	}
 	_this->suffix[ns++] = NULL;
+	if (conf->mbox_suffixes != NULL) {
+		_this->mbox_suffix = conf->mbox_suffixes;
+		conf->mbox_suffixes = NULL;
+	}
 
 	_thread_spin_init(&_this->id_seq_lock, 0);
+	_thread_spin_init(&_this->db_wait_lock, 0);
+	_thread_rwlock_init(&_this->db_lock, NULL);
 
 	memset(&sun, 0, sizeof(sun));
 	sun.sun_family = AF_UNIX;
@@ -297,6 +322,7 @@ mailestd_start(struct mailestd *_this, bool fg)
 	signal_add(&_this->evsigint,  NULL);
 	mailestd_on_timer(-1, 0, _this);    /* dummy to make a schedule */
 	time(&_this->curr_time);
+	mailestd_failed_load(_this);
 
 	/*
 	 * prepare limited number of tasks to control the resource usage.
@@ -310,8 +336,15 @@ mailestd_start(struct mailestd *_this, bool fg)
 
 	_this->workers[ntask++] = &_this->mainworker;
 	_this->workers[ntask++] = &_this->dbworker;
+	_this->workers[ntask++] = &_this->scanworker;
 	if (_this->monitor)
 		_this->workers[ntask++] = &_this->monitorworker;
+#ifdef MAILESTD_MT
+	/* searches are done by the dbworker unless threads are available */
+	_this->nsearchworkers = MAILESTD_SEARCH_NTHREADS;
+#endif
+	for (i = 0; i < _this->nsearchworkers; i++)
+		_this->workers[ntask++] = &_this->searchworkers[i].worker;
 	_this->workers[ntask++] = NULL;
 	for (i = 0; _this->workers[i] != NULL; i++) {
 		task_worker_init(_this->workers[i], _this);
@@ -322,8 +355,11 @@ mailestd_start(struct mailestd *_this, bool fg)
 #ifdef MAILESTD_MT
 	task_worker_start(&_this->mainworker);	/* this thread */
 	task_worker_run(&_this->dbworker);	/* another thread */
+	task_worker_run(&_this->scanworker);	/* another thread */
 	if (_this->monitor)
 		mailestd_monitor_run(_this);	/* another thread */
+	for (i = 0; i < _this->nsearchworkers; i++)
+		task_worker_run(&_this->searchworkers[i].worker);
 #endif
 
 	if (listen(_this->sock_ctl, 5) == -1)
@@ -332,6 +368,7 @@ mailestd_start(struct mailestd *_this, bool fg)
 
 	mailestd_log(LOG_INFO, "Started mailestd.  Process-Id=%d",
 	    (int)getpid());
+	mailestd_db_recover(_this);
 	mailestd_db_add_msgid_index(_this);
 	mailestd_schedule_db_sync(_this);
 }
@@ -384,10 +421,11 @@ mailestd_fini(struct mailestd *_this)
 	struct rfc822	 *msge, *msgt;
 	struct task	 *tske, *tskt;
 	struct gather	 *gate, *gatt;
+	struct dircache	 *dce, *dct;
 
 	TAILQ_FOREACH_SAFE(gate, &_this->gathers, queue, gatt) {
 		TAILQ_REMOVE(&_this->gathers, gate, queue);
-		free(gate);
+		gather_free(gate);
 	}
 	TAILQ_FOREACH_SAFE(tske, &_this->gather_pendings, queue, tskt) {
 		TAILQ_REMOVE(&_this->gather_pendings, tske, queue);
@@ -400,10 +438,17 @@ mailestd_fini(struct mailestd *_this)
 	TAILQ_FOREACH_SAFE(msge, &_this->rfc822_pendings, queue, msgt) {
 		TAILQ_REMOVE(&_this->rfc822_pendings, msge, queue);
 	}
+	TAILQ_FOREACH_SAFE(msge, &_this->rfc822_bodies, queue, msgt) {
+		TAILQ_REMOVE(&_this->rfc822_bodies, msge, queue);
+	}
 	RB_FOREACH_SAFE(msge, rfc822_tree, &_this->root, msgt) {
 		RB_REMOVE(rfc822_tree, &_this->root, msge);
 		rfc822_free(msge);
 	}
+	RB_FOREACH_SAFE(dce, dircache_tree, &_this->dircache, dct) {
+		RB_REMOVE(dircache_tree, &_this->dircache, dce);
+		dircache_free(dce);
+	}
 	mailestd_monitor_fini(_this);
 
 	if (_this->suffix != NULL) {
@@ -411,14 +456,25 @@ mailestd_fini(struct mailestd *_this)
 			free(_this->suffix[i]);
 	}
 	free(_this->suffix);
+	if (_this->mbox_suffix != NULL) {
+		for (i = 0; !isnull(_this->mbox_suffix[i]); i++)
+			free(_this->mbox_suffix[i]);
+	}
+	free(_this->mbox_suffix);
 	if (_this->folder != NULL) {
 		for (i = 0; !isnull(_this->folder[i]); i++)
 			free(_this->folder[i]);
 	}
 	free(_this->folder);
+	for (i = 0; i < _this->nmonitor_folders; i++)
+		free(_this->monitor_folders[i].folder);
+	free(_this->monitor_folders);
 	free(_this->sync_prev);
+	mailestd_draft_cache_clear(_this);
 
 	_thread_spin_destroy(&_this->id_seq_lock);
+	_thread_spin_destroy(&_this->db_wait_lock);
+	_thread_rwlock_destroy(&_this->db_lock);
 }
 
 static struct gather *
@@ -584,6 +640,7 @@ mailestd_db_open_wr(struct mailestd *_this)
 	ESTDB	*db = NULL;
 	int	 ecode;
 
+	mailestd_db_lock(_this);
 	if (_this->db != NULL) {
 		if (_this->db_wr)
 			return (_this->db);
@@ -596,11 +653,27 @@ mailestd_db_open_wr(struct mailestd *_this)
 	if ((db = est_db_open(_this->dbpath,
 	    ESTDBWRITER | ESTDBCREAT | ESTDBHUGE, &ecode)) == NULL) {
 		mailestd_log(LOG_ERR, "Opening DB: %s", est_err_msg(ecode));
+		mailestd_db_publish(_this);
 		mailestd_db_error(_this);
 	} else  {
 		_this->db = db;
 		_this->db_wr = true;
 		mailestd_log(LOG_INFO, "Opened DB for writing");
+		mailestd_db_load_garbage(_this);
+		if (db->dnum == 0) {
+			/*
+			 * Building the database from scratch.  Load it by a
+			 * large cache without flushing or optimizing until
+			 * all the messages are put.
+			 */
+			mailestd_log(LOG_INFO, "DB is empty, bulk loading");
+			est_db_set_cache_size(db, MAILESTD_DBBULKCACHESIZ, -1,
+			    -1, -1);
+			_thread_spin_lock(&_this->db_wait_lock);
+			_this->db_bulk = true;
+			_thread_spin_unlock(&_this->db_wait_lock);
+			_this->db_bulk_time = _this->curr_time;
+		}
 	}
 
 	return (db);
@@ -620,6 +693,400 @@ mailestd_db_close(struct mailestd *_this)
 			    est_err_msg(ecode));
 		_this->db = NULL;
 	}
+	if (_this->db_bulk) {
+		_thread_spin_lock(&_this->db_wait_lock);
+		_this->db_bulk = false;
+		_thread_spin_unlock(&_this->db_wait_lock);
+	}
+	mailestd_db_publish(_this);
+}
+
+/*
+ * The searchers read the database by their own handles without the lock
+ * of the file, so they must not read while the database is being written.
+ * The lock is held from the first write until the contents are synced.
+ */
+static void
+mailestd_db_lock(struct mailestd *_this)
+{
+	if (_this->db_locked)
+		return;
+	_thread_rwlock_wrlock(&_this->db_lock);
+	_this->db_locked = true;
+	clock_gettime(CLOCK_MONOTONIC, &_this->db_locktime);
+}
+
+/* close the database which hasn't been written for a while */
+static void
+mailestd_db_on_idle(int fd, short evmask, void *ctx)
+{
+	struct mailestd	*_this = ctx;
+
+	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
+	if (_this->db != NULL && _this->db_wr) {
+		mailestd_log(LOG_INFO, "Closing DB (idle)");
+		if (debug > 1)
+			est_db_set_informer(_this->db, mailestd_db_informer,
+			    NULL);
+		mailestd_db_close(_this);
+		mailestd_log(LOG_INFO, "Closed DB");
+		mailestd_db_stats_log(_this);
+	}
+}
+
+/* sync the database and let the searchers reopen it */
+static void
+mailestd_db_publish(struct mailestd *_this)
+{
+	char	 buf[32];
+
+	if (!_this->db_locked)
+		return;
+	if (_this->db != NULL && _this->db_wr) {
+		/* syncing flushes the rest of the cache */
+		_this->db_stats.unoptimized +=
+		    est_db_used_cache_size(_this->db);
+		snprintf(buf, sizeof(buf), "%d", _this->db_stats.garbage);
+		est_db_add_meta(_this->db, MAILESTD_DBMETA_GARBAGE, buf);
+		if (!est_db_sync(_this->db))
+			mailestd_log(LOG_ERR, "est_db_sync: %s",
+			    est_err_msg(est_db_error(_this->db)));
+	}
+	_this->db_gen++;
+	_this->db_locked = false;
+	_thread_rwlock_unlock(&_this->db_lock);
+}
+
+/*
+ * The documents deleted without cleaning are left in the index until the
+ * database is purged.  The number is kept in the database to resume it.
+ */
+static void
+mailestd_db_load_garbage(struct mailestd *_this)
+{
+	char	*val;
+
+	if ((val = est_db_meta(_this->db, MAILESTD_DBMETA_GARBAGE)) != NULL) {
+		_this->db_stats.garbage = strtol(val, NULL, 10);
+		free(val);
+	} else
+		/* not purged by us yet, estimate by the ids used */
+		_this->db_stats.garbage = _this->db->dseq - _this->db->dnum;
+	if (_this->db_stats.garbage > 0)
+		mailestd_log(LOG_INFO, "DB has %d documents to be purged",
+		    _this->db_stats.garbage);
+}
+
+/*
+ * Finish the bulk loading when no message is left to be put.  The cache
+ * is flushed and the database is optimized at once, then it is closed to
+ * be opened by the usual cache.
+ */
+static void
+mailestd_db_bulk_done(struct mailestd *_this)
+{
+	ESTDB	*db = _this->db;
+	int	 ndocs;
+
+	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
+	if (!TAILQ_EMPTY(&_this->gathers) ||
+	    !TAILQ_EMPTY(&_this->gather_pendings) ||
+	    !TAILQ_EMPTY(&_this->rfc822_pendings) ||
+	    !TAILQ_EMPTY(&_this->rfc822_bodies) || _this->rfc822_ntask > 0)
+		return;
+
+	ndocs = db->dnum;
+	mailestd_log(LOG_INFO, "Flushing DB loaded %d docs", ndocs);
+	if (debug > 1)
+		est_db_set_informer(db, mailestd_db_informer, NULL);
+	if (!est_db_flush(db, -1))
+		mailestd_log(LOG_ERR, "est_db_flush: %s",
+		    est_err_msg(est_db_error(db)));
+	if (!est_db_optimize(db, ESTOPTNOPURGE))
+		mailestd_log(LOG_ERR, "est_db_optimize: %s",
+		    est_err_msg(est_db_error(db)));
+	_this->db_stats.optimizes++;
+	_this->db_stats.unoptimized = 0;
+	mailestd_db_close(_this);
+	mailestd_log(LOG_INFO, "Bulk loaded DB %d docs in %d sec", ndocs,
+	    (int)(_this->curr_time - _this->db_bulk_time));
+}
+
+/* the number of the searches waiting for the db lock */
+static int
+mailestd_db_waiters(struct mailestd *_this)
+{
+	int	 waiters;
+
+	_thread_spin_lock(&_this->db_wait_lock);
+	waiters = _this->db_waiters;
+	_thread_spin_unlock(&_this->db_wait_lock);
+
+	return (waiters);
+}
+
+/* whether the other tasks or the searches are waiting for the db */
+static bool
+mailestd_db_interrupted(struct mailestd *_this)
+{
+	bool	 busy;
+
+	if (mailestd_db_waiters(_this) > 0)
+		return (true);
+	_thread_mutex_lock(&_this->dbworker.lock);
+	busy = !TAILQ_EMPTY(&_this->dbworker.head);
+	_thread_mutex_unlock(&_this->dbworker.lock);
+
+	return (busy);
+}
+
+/* sync the database for the searches, but keep it open until idle */
+static void
+mailestd_db_rest(struct mailestd *_this)
+{
+	struct timeval	 tv;
+
+	mailestd_db_publish(_this);
+	if (!event_initialized(&_this->db_idletimer))
+		EVENT_SET(&_this->db_idletimer, -1, EV_TIMEOUT,
+		    mailestd_db_on_idle, _this);
+	tv.tv_sec = MAILESTD_DBIDLE;
+	tv.tv_usec = 0;
+	event_add(&_this->db_idletimer, &tv);
+}
+
+/*
+ * Maintain the database written within the io budget.  The cache is
+ * flushed in small steps not to stall the searches by a long sync, then
+ * the database is optimized when enough is flushed since the last time,
+ * or purged and compacted when enough documents were deleted without
+ * cleaning.  Purging and compacting are separate steps and the database
+ * is published before and after each, so the searches may get in between
+ * them.  Hyper Estraier can't break them further.  A step is not started
+ * while the other tasks are waiting.
+ * The flushing is not deferred by the budget since the database is locked
+ * until it's done, but it is charged to the optimizing which is deferred
+ * after the searches are let in.  Returns 1 when a step is done, 0 when
+ * nothing is left and -1 when it is deferred by the budget.
+ */
+static int
+mailestd_db_maintain(struct mailestd *_this)
+{
+	ESTDB			*db = _this->db;
+	struct mailestd_dbstats	*stats = &_this->db_stats;
+	struct timespec		 start, now, diffts;
+	struct timeval		 tv;
+	long			 msec, rest;
+	int			 cache, ndocs, opts;
+	double			 size, flushed;
+
+	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
+	MAILESTD_ASSERT(db != NULL && _this->db_wr);
+
+	if (mailestd_db_waiters(_this) > 0 || _this->rebuild != NULL)
+		/* the searches first, the sync will flush the rest */
+		return (0);
+
+	cache = est_db_used_cache_size(db);
+	ndocs = est_db_doc_num(db);
+	size = est_db_size(db);
+	if (cache > MAILESTD_DBFLUSHSIZ)
+		opts = -1;			/* flush */
+	else if (_this->db_compact)
+		opts = ESTOPTNOPURGE;		/* compact after purging */
+	else if (stats->garbage >= MAILESTD_DBPURGEMIN &&
+	    (double)stats->garbage * 100 >=
+	    (double)ndocs * MAILESTD_DBPURGERATIO)
+		opts = ESTOPTNODBOPT;		/* purge */
+	else if (size > 0 &&
+	    stats->unoptimized * 100 >= size * MAILESTD_DBFRAGRATIO)
+		opts = ESTOPTNOPURGE | ESTOPTNODBOPT;
+	else
+		return (0);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (opts != -1 && timespeccmp(&start, &_this->db_maintnext, <)) {
+		/* never keep the searches waiting for the budget */
+		mailestd_db_publish(_this);
+		timespecsub(&_this->db_maintnext, &start, &diffts);
+		TIMESPEC_TO_TIMEVAL(&tv, &diffts);
+		if (!event_initialized(&_this->db_mainttimer))
+			EVENT_SET(&_this->db_mainttimer, -1, EV_TIMEOUT,
+			    mailestd_db_on_maint, _this);
+		event_add(&_this->db_mainttimer, &tv);
+		stats->deferred++;
+		return (-1);
+	}
+
+	if (opts == -1) {
+		do {
+			if (!est_db_flush(db, MAILESTD_DBFLUSHSIZ)) {
+				mailestd_log(LOG_ERR, "est_db_flush: %s",
+				    est_err_msg(est_db_error(db)));
+				return (0);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timespecsub(&now, &start, &diffts);
+			msec = diffts.tv_sec * 1000 + diffts.tv_nsec / 1000000;
+		} while (msec < MAILESTD_DBMAINTSLICE &&
+		    !mailestd_db_interrupted(_this) &&
+		    est_db_used_cache_size(db) > MAILESTD_DBFLUSHSIZ);
+		flushed = cache - est_db_used_cache_size(db);
+		stats->flushes++;
+		stats->flushed += flushed;
+		stats->unoptimized += flushed;
+		if (debug > 1)
+			mailestd_log(LOG_DEBUG, "Flushed DB %.0f bytes in %ld "
+			    "msec, %d bytes left", flushed, msec,
+			    est_db_used_cache_size(db));
+	} else {
+		/* let the searches see the latest before the long step */
+		mailestd_db_publish(_this);
+		mailestd_db_lock(_this);
+		if (opts == ESTOPTNOPURGE)
+			mailestd_log(LOG_INFO, "Compacting DB purged");
+		else if (opts & ESTOPTNOPURGE)
+			mailestd_log(LOG_INFO, "Optimizing DB, %.0f bytes "
+			    "flushed since the last (%.0f%% of the size)",
+			    stats->unoptimized,
+			    stats->unoptimized * 100 / size);
+		else
+			mailestd_log(LOG_INFO, "Purging DB, %d of %d "
+			    "documents deleted without cleaning",
+			    stats->garbage, ndocs);
+		if (!est_db_optimize(db, opts))
+			mailestd_log(LOG_ERR, "est_db_optimize: %s",
+			    est_err_msg(est_db_error(db)));
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timespecsub(&now, &start, &diffts);
+		msec = diffts.tv_sec * 1000 + diffts.tv_nsec / 1000000;
+		if (opts == ESTOPTNOPURGE)
+			_this->db_compact = false;
+		else if (opts & ESTOPTNOPURGE)
+			stats->optimizes++;
+		else {
+			stats->purges++;
+			stats->garbage = 0;
+			_this->db_compact = true;
+		}
+		stats->unoptimized = 0;
+		mailestd_log(LOG_INFO, "%s DB in %ld msec",
+		    (opts == ESTOPTNOPURGE)? "Compacted" :
+		    (opts & ESTOPTNOPURGE)? "Optimized" : "Purged", msec);
+		mailestd_db_publish(_this);
+	}
+	stats->msec += msec;
+
+	/* rest (1000 - budget) msec for each budget msec spent */
+	rest = msec * (1000 - _this->db_io_budget) / _this->db_io_budget;
+	diffts.tv_sec = rest / 1000;
+	diffts.tv_nsec = (rest % 1000) * 1000000L;
+	if (timespeccmp(&_this->db_maintnext, &now, <))
+		_this->db_maintnext = now;
+	timespecadd(&_this->db_maintnext, &diffts, &_this->db_maintnext);
+
+	return (1);
+}
+
+static void
+mailestd_db_on_maint(int fd, short evmask, void *ctx)
+{
+	struct mailestd	*_this = ctx;
+	struct timeval	 tv = { 0, 0 };
+
+	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
+	if (_this->db == NULL || !_this->db_wr)
+		return;
+	if (mailestd_db_interrupted(_this) && mailestd_db_waiters(_this) == 0)
+		/* resumed when the tasks run out */
+		return;
+	switch (mailestd_db_maintain(_this)) {
+	case 1:
+		/* the next step after the other events */
+		event_add(&_this->db_mainttimer, &tv);
+		break;
+	case 0:
+		mailestd_db_rest(_this);
+		break;
+	}
+}
+
+static void
+mailestd_db_stats_log(struct mailestd *_this)
+{
+	struct mailestd_dbstats	*stats = &_this->db_stats;
+
+	mailestd_log(LOG_INFO, "DB maintenance: flush=%u (%.0f bytes) "
+	    "optimize=%u purge=%u deferred=%u time=%ldmsec "
+	    "unoptimized=%.0f garbage=%d", stats->flushes, stats->flushed,
+	    stats->optimizes, stats->purges, stats->deferred, stats->msec,
+	    stats->unoptimized, stats->garbage);
+}
+
+/* inform the counts of the maintenance, on the database thread */
+static void
+mailestd_db_stats(struct mailestd *_this, struct task *task)
+{
+	char			 buf[512];
+	struct mailestd_dbstats	*stats = &_this->db_stats;
+
+	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
+	snprintf(buf, sizeof(buf),
+	    "Documents: %d\n"
+	    "Flushes: %u (%.0f bytes)\n"
+	    "Optimizes: %u\n"
+	    "Purges: %u\n"
+	    "Deferred: %u\n"
+	    "Maintenance time: %ld msec\n"
+	    "Unoptimized: %.0f bytes\n"
+	    "Garbage: %d\n"
+	    "%s",
+	    (_this->db != NULL)? est_db_doc_num(_this->db) : -1,
+	    stats->flushes, stats->flushed, stats->optimizes, stats->purges,
+	    stats->deferred, stats->msec, stats->unoptimized, stats->garbage,
+	    (_this->rebuild != NULL)? "Rebuilding\n" :
+	    (_this->db_bulk)? "Loading in bulk\n" : "");
+	mailestd_schedule_inform(_this, task->id, (u_char *)buf, strlen(buf));
+}
+
+/*
+ * A rebuilt database replaces the database by two renames.  If the process
+ * was terminated between them, put the rebuilt one in place.  Remove what
+ * is left by the rebuild terminated.
+ */
+static void
+mailestd_db_recover(struct mailestd *_this)
+{
+	int		 i;
+	char		 old[PATH_MAX], path[PATH_MAX];
+	struct stat	 st;
+
+	snprintf(old, sizeof(old), "%s.old", _this->dbpath);
+	if (lstat(old, &st) == -1)
+		goto rebuild_dir;
+	if (lstat(_this->dbpath, &st) == -1 && errno == ENOENT) {
+		snprintf(path, sizeof(path), "%s/%s", old,
+		    MAILESTD_REBUILD_DIR);
+		if (rename(path, _this->dbpath) == 0)
+			mailestd_log(LOG_INFO, "Recovered the rebuilt DB");
+		else if (rename(old, _this->dbpath) == 0)
+			mailestd_log(LOG_INFO, "Recovered DB from %s", old);
+		else {
+			mailestd_log(LOG_ERR, "rename(%s, %s): %m", old,
+			    _this->dbpath);
+			return;
+		}
+	}
+	est_rmdir_rec(old);
+rebuild_dir:
+	for (i = 0; i < MAILESTD_REBUILD_MAXTHREADS; i++) {
+		snprintf(path, sizeof(path), "%s/%s.%d", _this->dbpath,
+		    MAILESTD_REBUILD_DIR, i);
+		est_rmdir_rec(path);
+	}
+	snprintf(path, sizeof(path), "%s/%s", _this->dbpath,
+	    MAILESTD_REBUILD_DIR);
+	est_rmdir_rec(path);
 }
 
 static void
@@ -682,7 +1149,7 @@ mailestd_db_sync(struct mailestd *_this)
 	char		 dir[PATH_MAX + 128];
 	const char	*prev, *fn, *uri, *errstr, *folder, *ps;
 	ESTDOC		*doc;
-	struct rfc822	*msg, msg0, *msg1, *msg2;
+	struct rfc822	*msg, msg0, *msg1, *msg2, *msgt;
 	struct tm	 tm;
 	struct task	*tske, *tskt;
 
@@ -699,9 +1166,8 @@ mailestd_db_sync(struct mailestd *_this)
 			continue;
 
 		uri = est_doc_attr(doc, ESTDATTRURI);
-		if (uri == NULL || strncmp(uri, URIFILE "/", 8) != 0)
+		if (uri == NULL || (fn = doc2path(doc)) == NULL)
 			continue;
-		fn = URI2PATH(uri);
 
 		msg0.path = (char *)fn;
 		msg = RB_FIND(rfc822_tree, &_this->root, &msg0);
@@ -727,12 +1193,23 @@ mailestd_db_sync(struct mailestd *_this)
 			}
 		}
 		if (!msg->ontask && msg->db_id == 0) {
-			strptime(est_doc_attr(doc, ESTDATTRMDATE),
-			    MAILESTD_TIMEFMT, &tm);
 			msg->db_id = id;
-			msg->mtime = timegm(&tm);
-			msg->size = strtonum(est_doc_attr(doc, ESTDATTRSIZE), 0,
-			    INT64_MAX, &errstr);
+			msg->hash = rfc822_hash_attr(doc);
+			if (!msg->draftfailed) {
+				/* keep the mtime and size which failed */
+				strptime(est_doc_attr(doc, ESTDATTRMDATE),
+				    MAILESTD_TIMEFMT, &tm);
+				msg->mtime = timegm(&tm);
+				msg->size = strtonum(est_doc_attr(doc,
+				    ESTDATTRSIZE), 0, INT64_MAX, &errstr);
+			}
+		}
+		if (!msg->ontask && !msg->draftfailed &&
+		    est_doc_attr(doc, ATTR_HDRONLY) != NULL) {
+			/* only the headers are indexed, the body is left */
+			msg->ontask = true;
+			msg->bodypending = true;
+			TAILQ_INSERT_TAIL(&_this->rfc822_bodies, msg, queue);
 		}
 
 		msg->pariddone =
@@ -775,11 +1252,20 @@ mailestd_db_sync(struct mailestd *_this)
 		ldir = strlen(dir);
 		msg0.path = dir;
 		for (msg = RB_NFIND(rfc822_tree, &_this->root, &msg0);
-		    msg != NULL; msg = RB_NEXT(rfc822_tree, &_this->root, msg)){
+		    msg != NULL; msg = msgt) {
+			msgt = RB_NEXT(rfc822_tree, &_this->root, msg);
 			if (strncmp(msg->path, dir, ldir) != 0)
 				break;
+			/* the mbox may be being read, it's checked later */
+			if (mailestd_is_mbox_msg(_this, msg->path, NULL, NULL,
+			    NULL))
+				continue;
 			if (msg->fstime == 0 && !msg->ontask) {
-				mailestd_schedule_deldb(_this, NULL, msg);
+				if (msg->db_id != 0)
+					mailestd_schedule_deldb(_this, NULL,
+					    msg);
+				else
+					mailestd_failed_forget(_this, msg);
 				delete++;
 			}
 		}
@@ -789,6 +1275,8 @@ mailestd_db_sync(struct mailestd *_this)
 		free(tske);
 	}
 	_this->db_sync_time = _this->curr_time;
+	while (mailestd_reschedule_draft(_this) != 0)
+		/* start indexing the bodies left */;
 	if (_this->paridguess) {
 		mailestd_guess_parid(_this);
 		_this->paridnotdone = 0;
@@ -819,14 +1307,30 @@ mailestd_gather_start(struct mailestd *_this, struct task_gather *task)
 	TAILQ_INIT(&tskq);
 
 	strlcpy(folder, task->folder, sizeof(folder));
-	ctx = xcalloc(1, sizeof(struct gather));
-	ctx->id = task->gather_id;
-
 	if (isnull(folder))
-		strlcpy(ctx->target, "all", sizeof(ctx->target));
+		strlcpy(path, "all", sizeof(path));
 	else
-		mailestd_folder_name(_this, folder, ctx->target,
-		    sizeof(ctx->target));
+		mailestd_folder_name(_this, folder, path, sizeof(path));
+
+	/*
+	 * Join the gather for the same target if none of its folders is
+	 * scanned yet.  The scan will see the changes before this request.
+	 */
+	TAILQ_FOREACH(ctx, &_this->gathers, queue) {
+		if (ctx->folders > 0 && strcmp(ctx->target, path) == 0 &&
+		    mailestd_gather_queued(_this, ctx) == ctx->folders) {
+			ctx->joined = xreallocarray(ctx->joined,
+			    ctx->njoined + 1, sizeof(uint64_t));
+			ctx->joined[ctx->njoined++] = task->gather_id;
+			mailestd_log(LOG_DEBUG, "Joined the gather for %s",
+			    ctx->target);
+			return (0);
+		}
+	}
+
+	ctx = xcalloc(1, sizeof(struct gather));
+	ctx->id = task->gather_id;
+	strlcpy(ctx->target, path, sizeof(ctx->target));
 	TAILQ_INSERT_TAIL(&_this->gathers, ctx, queue);
 
 	if (folder[0] != '\0') {
@@ -914,85 +1418,61 @@ mailestd_gather_start(struct mailestd *_this, struct task_gather *task)
 	 */
 	TAILQ_FOREACH_SAFE(tske, &tskq, queue, tskt) {
 		TAILQ_REMOVE(&tskq, tske, queue);
-		task_worker_add_task(&_this->dbworker, tske);
+		task_worker_add_task(&_this->scanworker, tske);
 	}
 
 	return (0);
 }
 
-
-
-
-static int
+/*
+ * Apply the result of the scan to the messages.  Since this may take long
+ * for the large folder, this returns true to tell the task is scheduled
+ * again after MAILESTD_GATHER_NITER messages, to let the other tasks run.
+ */
+static bool
 mailestd_gather(struct mailestd *_this, struct task_gather *task)
 {
-	int		 lrdir, update = 0, delete = 0, total = 0;
-	char		 rdir[PATH_MAX], buf[PATH_MAX], *paths[2];
-	const char	*folder = task->folder;
+	int		 niter = 0;
+	char		 buf[PATH_MAX];
 	struct gather	*ctx;
-	FTS		*fts;
-	struct rfc822	*msge, msg0;
-	time_t		 curr_time;
-	struct folder	*flde, *fldt;
-	struct folder_tree
-			 folders;
+	struct scan_dir	*dir;
 
 	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
-	RB_INIT(&folders);
 	ctx = mailestd_get_gather(_this, task->gather_id);
 	MAILESTD_ASSERT(ctx != NULL);
-	if (folder[0] == '/')
-		strlcpy(rdir, folder, sizeof(rdir));
-	else {
-		strlcpy(rdir, _this->maildir, sizeof(rdir));
-		strlcat(rdir, "/", sizeof(rdir));
-		strlcat(rdir, folder, sizeof(rdir));
-	}
-	mailestd_log(LOG_DEBUG, "Gathering %s ...", mailestd_folder_name(
-	    _this, rdir, buf, sizeof(buf)));
-	paths[0] = rdir;
-	paths[1] = NULL;
-	lrdir = strlen(rdir);
-
-	if ((fts = fts_open(paths, FTS_LOGICAL | FTS_NOCHDIR,
-	    mailestd_fts_compar)) == NULL) {
-		mailestd_log(LOG_ERR, "fts_open(%s): %m", folder);
+	if (task->scanerr) {
+		/* keep the messages, it might be a temporary error */
 		goto out;
 	}
-	curr_time = _this->curr_time;
-	update = mailestd_fts(_this, ctx, curr_time, fts, fts_read(fts),
-	    &folders);
-	fts_close(fts);
-
-	MAILESTD_ASSERT(lrdir + 1 < (int)sizeof(rdir));
-	rdir[lrdir++] = '/';
-	rdir[lrdir] = '\0';
-
-	msg0.path = rdir;
-	for (msge = RB_NFIND(rfc822_tree, &_this->root, &msg0);
-	    msge != NULL; msge = RB_NEXT(rfc822_tree, &_this->root, msge)) {
-		if (strncmp(msge->path, rdir, lrdir) != 0)
-			break;
-		total++;
-		if (msge->fstime != curr_time) {
-			delete++;
-			if (msge->ontask)
-				/* other task is running */;
-			else {
-				MAILESTD_ASSERT(msge->db_id != 0);
-				mailestd_schedule_deldb(_this, ctx, msge);
-			}
+	if (task->fstime == 0)
+		task->fstime = _this->curr_time;
+
+	/* a directory is merged at once since the tree may be changed */
+	while ((dir = TAILQ_FIRST(&task->dirs)) != NULL) {
+		if (niter >= MAILESTD_GATHER_NITER) {
+			task_worker_add_task(&_this->dbworker,
+			    (struct task *)task);
+			return (true);
 		}
+		TAILQ_REMOVE(&task->dirs, dir, queue);
+		if (!dir->missing && _this->monitor)
+			mailestd_schedule_monitor(_this, dir->path);
+		mailestd_gather_merge(_this, ctx, task, dir, task->fstime);
+		niter += (dir->skipped)? dir->nmsgs : dir->nents;
+		scan_dir_free(dir);
 	}
 
+	if (task->folder[0] == '/')
+		mailestd_folder_name(_this, task->folder, buf, sizeof(buf));
+	else
+		snprintf(buf, sizeof(buf), "+%s", task->folder);
 	mailestd_log(LOG_DEBUG, "Gathered %s (Total: %d Remove: %d Update: %d)",
-	    mailestd_folder_name(_this, rdir, buf, sizeof(buf)),
-	    total, delete, update);
+	    buf, task->total, task->delete, task->update);
 out:
 	if (ctx != NULL) {
 		if (ctx->puts == ctx->puts_done &&
 		    ctx->dels == ctx->dels_done &&
-		    (update > 0 || delete > 0)) {
+		    (task->update > 0 || task->delete > 0)) {
 			strlcpy(ctx->errmsg, "other task exists",
 			    sizeof(ctx->errmsg));
 			mailestd_gather_inform(_this, NULL, ctx);
@@ -1004,14 +1484,169 @@ out:
 		} else
 			mailestd_gather_inform(_this, (struct task *)task, ctx);
 	}
-	RB_FOREACH_SAFE(flde, folder_tree, &folders, fldt) {
-		RB_REMOVE(folder_tree, &folders, flde);
-		if (_this->monitor)
-			mailestd_schedule_monitor(_this, flde->path);
-		folder_free(flde);
+	while ((dir = TAILQ_FIRST(&task->dirs)) != NULL) {
+		TAILQ_REMOVE(&task->dirs, dir, queue);
+		scan_dir_free(dir);
 	}
 
-	return (0);
+	return (false);
+}
+
+/*
+ * Merge the listing of a directory with the messages in the tree in one
+ * pass.  Both are in strcmp() order.  The messages in the subdirectories
+ * are skipped by jumping over their range, they are merged with the
+ * listing of the subdirectory.  Then the found messages are processed in
+ * the order of the listing to schedule the drafts in numeric order.  The
+ * mboxes which size is changed are read by the scanner again.
+ */
+static void
+mailestd_gather_merge(struct mailestd *_this, struct gather *ctx,
+    struct task_gather *task, struct scan_dir *dir, time_t curr_time)
+{
+	int		 i, j, ldir, nmsgs = 0, cmp, ngone = 0;
+	size_t		 lmbox;
+	off_t		 end, lastmsg;
+	char		 path[PATH_MAX], sub[PATH_MAX];
+	const char	*tail, *ps, *subname;
+	struct rfc822	*msg, *msgt, msg0, **found = NULL, **gone = NULL;
+	struct walk_ent	*ent;
+
+	if (strlcpy(path, dir->path, sizeof(path)) >= sizeof(path) ||
+	    strlcat(path, "/", sizeof(path)) >= sizeof(path))
+		return;
+	ldir = strlen(path);
+	if (dir->nents > 0)
+		found = xcalloc(dir->nents, sizeof(struct rfc822 *));
+
+	msg0.path = path;
+	i = 0;
+	for (msg = RB_NFIND(rfc822_tree, &_this->root, &msg0); msg != NULL;
+	    msg = msgt) {
+		if (strncmp(msg->path, path, ldir) != 0)
+			break;
+		tail = msg->path + ldir;
+		if ((ps = strchr(tail, '/')) != NULL) {
+			strlcpy(sub, tail, MINIMUM((size_t)(ps - tail) + 1,
+			    sizeof(sub)));
+			subname = sub;
+			if (bsearch(&subname, dir->subdirs, dir->nsubdirs,
+			    sizeof(char *), str_compar) != NULL) {
+				/* jump to the next of the subdirectory */
+				strlcpy(sub, msg->path, MINIMUM(
+				    (size_t)(ps - msg->path) + 1, sizeof(sub)));
+				strlcat(sub, "0", sizeof(sub));	/* '/' + 1 */
+				msg0.path = sub;
+				msgt = RB_NFIND(rfc822_tree, &_this->root,
+				    &msg0);
+				continue;
+			}
+			/* the subdirectory is removed */
+			msgt = RB_NEXT(rfc822_tree, &_this->root, msg);
+			if (!dir->skipped)
+				mailestd_gather_delete(_this, ctx, task, msg,
+				    curr_time);
+			continue;
+		}
+		msgt = RB_NEXT(rfc822_tree, &_this->root, msg);
+		if (mailestd_is_mbox_msg(_this, msg->path, &lmbox, NULL, NULL)) {
+			strlcpy(sub, tail, MINIMUM(lmbox - ldir + 1,
+			    sizeof(sub)));
+			if (bsearch(sub, dir->mboxes, dir->nmboxes,
+			    sizeof(struct walk_ent), walk_ent_key_compar)
+			    != NULL) {
+				/* the new messages are checked later */
+				task->total++;
+				msg->fstime = curr_time;
+			} else if (!dir->skipped)
+				mailestd_gather_delete(_this, ctx, task, msg,
+				    curr_time);
+			continue;
+		}
+		task->total++;
+		if (dir->skipped) {
+			msg->fstime = curr_time;
+			nmsgs++;
+			continue;
+		}
+		cmp = 1;
+		while (i < dir->nents &&
+		    (cmp = strcmp(dir->byname[i]->name, tail)) < 0)
+			i++;
+		if (cmp == 0) {
+			found[dir->byname[i] - dir->ents] = msg;
+			i++;
+			continue;
+		}
+		/* may be renamed in Maildir, delete it later */
+		if ((ngone % 64) == 0)
+			gone = xreallocarray(gone, ngone + 64,
+			    sizeof(struct rfc822 *));
+		gone[ngone++] = msg;
+	}
+	if (dir->skipped) {
+		if (nmsgs != dir->nmsgs)
+			/* not consistent, walk the directory next time */
+			mailestd_schedule_dircache_invalidate(_this, dir->path,
+			    strlen(dir->path));
+		return;
+	}
+
+	for (j = 0; j < dir->nents; j++) {
+		ent = &dir->ents[j];
+		if (strlcpy(path + ldir, ent->name, sizeof(path) - ldir) >=
+		    sizeof(path) - ldir)
+			continue;
+		if (mailestd_gather_file(_this, ctx, curr_time, found[j], path,
+		    ent))
+			task->update++;
+	}
+	for (j = 0; j < ngone; j++)
+		mailestd_gather_delete(_this, ctx, task, gone[j], curr_time);
+	free(found);
+	free(gone);
+
+	for (j = 0; j < dir->nmboxes; j++) {
+		ent = &dir->mboxes[j];
+		if (strlcpy(path + ldir, ent->name, sizeof(path) - ldir) >=
+		    sizeof(path) - ldir)
+			continue;
+		if ((end = mailestd_mbox_end(_this, path, &lastmsg)) ==
+		    ent->size)
+			continue;
+		/* read only the appended part unless it's shrunk */
+		mailestd_schedule_mbox_scan(_this, ctx, path, ent,
+		    (ent->size < end)? 0 : end, lastmsg, (ent->size < end),
+		    curr_time);
+	}
+}
+
+static void
+mailestd_gather_delete(struct mailestd *_this, struct gather *ctx,
+    struct task_gather *task, struct rfc822 *msg, time_t curr_time)
+{
+	/*
+	 * Compare with "<" rather than "!=", the other gather which started
+	 * later might have seen the message.
+	 */
+	if (msg->fstime >= curr_time)
+		return;
+	task->delete++;
+	mailestd_remove(_this, ctx, msg);
+}
+
+static void
+mailestd_remove(struct mailestd *_this, struct gather *ctx,
+    struct rfc822 *msg)
+{
+	if (msg->ontask)
+		/* other task is running */;
+	else if (msg->db_id == 0) {
+		/* only in the list of the failed drafts */
+		MAILESTD_ASSERT(msg->draftfailed);
+		mailestd_failed_forget(_this, msg);
+	} else
+		mailestd_schedule_deldb(_this, ctx, msg);
 }
 
 static void
@@ -1029,7 +1664,12 @@ mailestd_gather_inform(struct mailestd *_this, struct task *task,
 		default:
 			break;
 
-		case MAILESTD_TASK_GATHER:
+		case MAILESTD_TASK_UPDATE_FILES:
+			if (((struct task_update_files *)task)->more)
+				break;
+			/* FALLTHROUGH */
+		case MAILESTD_TASK_GATHER_APPLY:
+		case MAILESTD_TASK_MBOX_APPLY:
 			if (++gather->folders_done == gather->folders && (
 			    gather->dels_done == gather->dels ||
 			    gather->puts_done == gather->puts))
@@ -1049,8 +1689,7 @@ mailestd_gather_inform(struct mailestd *_this, struct task *task,
 			break;
 		}
 		if (notice > 0)
-			mailestd_schedule_inform(_this, gather->id,
-			    (u_char *)gather, sizeof(struct gather));
+			mailestd_gather_notify(_this, gather);
 		if (gather->folders_done == gather->folders &&
 		    gather->dels_done == gather->dels &&
 		    gather->puts_done == gather->puts) {
@@ -1060,127 +1699,1198 @@ mailestd_gather_inform(struct mailestd *_this, struct task *task,
 			    gather->folders_done, gather->dels_done,
 			    gather->puts_done);
 			TAILQ_REMOVE(&_this->gathers, gather, queue);
-			free(gather);
+			gather_free(gather);
 		}
 	} else {
 		mailestd_log(LOG_INFO,
 		    "Updating %s failed (Folders: %d Remove: %d Update: %d): "
 		    "%s", gather->target, gather->folders_done,
 		    gather->dels_done, gather->puts_done, gather->errmsg);
-		mailestd_schedule_inform(_this, gather->id,
-		    (u_char *)gather, sizeof(struct gather));
+		mailestd_gather_notify(_this, gather);
 		TAILQ_REMOVE(&_this->gathers, gather, queue);
-		free(gather);
+		gather_free(gather);
 	}
 }
 
+/* inform the progress to the requester and the joined requesters */
+static void
+mailestd_gather_notify(struct mailestd *_this, struct gather *gather)
+{
+	int	 i;
+
+	mailestd_schedule_inform(_this, gather->id, (u_char *)gather,
+	    sizeof(struct gather));
+	for (i = 0; i < gather->njoined; i++)
+		mailestd_schedule_inform(_this, gather->joined[i],
+		    (u_char *)gather, sizeof(struct gather));
+}
+
+/* count the tasks of the gather which are not picked by the scanner yet */
 static int
-mailestd_fts(struct mailestd *_this, struct gather *ctx, time_t curr_time,
-    FTS *fts, FTSENT *ftse, struct folder_tree *folders)
+mailestd_gather_queued(struct mailestd *_this, struct gather *gather)
 {
-	int		 i, j, update = 0;
-	const char	*bn, *errstr;
-	struct rfc822	*msg, msg0;
-	bool		 needupdate = false;
-	char		 uri[PATH_MAX + 128];
-	struct tm	 tm;
-	ESTDOC		*doc;
-	int		 db_id;
-	struct folder	*fld;
+	int		 count = 0;
+	struct task	*task;
 
-	strlcpy(uri, URIFILE, sizeof(uri));
-	do {
-		needupdate = false;
-		if (ftse == NULL)
-			break;
-		if (_this->monitor && ftse->fts_info == FTS_D) {
-			fld = xcalloc(1, sizeof(struct folder));
-			fld->path = xstrdup(ftse->fts_path);
-			RB_INSERT(folder_tree, folders, fld);
-		}
-		if (!(ftse->fts_info == FTS_F || ftse->fts_info == FTS_SL))
-			continue;
+	_thread_mutex_lock(&_this->scanworker.lock);
+	TAILQ_FOREACH(task, &_this->scanworker.head, queue) {
+		if (task->type == MAILESTD_TASK_GATHER &&
+		    ((struct task_gather *)task)->gather_id == gather->id)
+			count++;
+	}
+	_thread_mutex_unlock(&_this->scanworker.lock);
 
-		bn = ftse->fts_name;
-		for (i = 0; bn[i] != '\0'; i++) {
-			if (!isdigit((unsigned char)bn[i]))
-				break;
+	return (count);
+}
+
+static void
+gather_free(struct gather *gather)
+{
+	free(gather->joined);
+	free(gather);
+}
+
+/*
+ * Make the path given to update-files the one used by the gathering.  The
+ * directory is resolved since the file may not exist, then the path must
+ * be in the maildir and its folder must be one of the folders.
+ */
+static bool
+mailestd_update_files_path(struct mailestd *_this, const char *p,
+    char *path, size_t pathsiz)
+{
+	char		 dir[PATH_MAX], rdir[PATH_MAX], name[NAME_MAX + 1];
+	char		*sl;
+	const char	*folder;
+
+	if (p[0] == '+')
+		snprintf(dir, sizeof(dir), "%s/%s", _this->maildir, p + 1);
+	else if (p[0] == '/')
+		strlcpy(dir, p, sizeof(dir));
+	else
+		return (false);
+	sl = strrchr(dir, '/');
+	if (strlcpy(name, sl + 1, sizeof(name)) >= sizeof(name) ||
+	    name[0] == '\0')
+		return (false);
+	*sl = '\0';
+	if (realpath((dir[0] == '\0')? "/" : dir, rdir) == NULL ||
+	    (size_t)snprintf(path, pathsiz, "%s/%s", rdir, name) >= pathsiz)
+		return (false);
+	if (!is_parent_dir(_this->maildir, path)) {
+		mailestd_log(LOG_WARNING, "%s is not in the maildir", path);
+		return (false);
+	}
+	/* check the top folder and the folder itself like the gathering */
+	folder = path + _this->lmaildir + 1;
+	if ((sl = strchr(folder, '/')) == NULL)
+		return (false);		/* not in a folder */
+	strlcpy(dir, folder, MINIMUM(sizeof(dir), (size_t)(sl - folder) + 1));
+	if (!mailestd_folder_match(_this, dir))
+		return (false);
+	sl = strrchr(folder, '/');
+	strlcpy(dir, folder, MINIMUM(sizeof(dir), (size_t)(sl - folder) + 1));
+	if (!mailestd_folder_match(_this, dir))
+		return (false);
+
+	return (true);
+}
+
+/*
+ * Update or remove the given messages without walking the folders.  The
+ * list is handled as a gather of one folder which is done by the last.
+ * A path prefixed by '<' is the old path of the next one which is renamed.
+ */
+static void
+mailestd_update_files(struct mailestd *_this, struct task_update_files *task)
+{
+	int		 update = 0, delete = 0;
+	u_int		 seq;
+	off_t		 end, lastmsg;
+	char		 path[PATH_MAX], frompath[PATH_MAX];
+	const char	*p, *pe, *name, *from = NULL, *from0;
+	struct gather	*ctx;
+	struct rfc822	*msg, *msgf, msg0;
+	struct stat	 st;
+	struct walk_ent	 ent;
+
+	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
+	if ((ctx = mailestd_get_gather(_this, task->gather_id)) == NULL) {
+		ctx = xcalloc(1, sizeof(struct gather));
+		ctx->id = task->gather_id;
+		ctx->folders = 1;
+		strlcpy(ctx->target, "files", sizeof(ctx->target));
+		TAILQ_INSERT_TAIL(&_this->gathers, ctx, queue);
+	}
+
+	pe = task->paths + task->pathsiz;
+	for (p = task->paths; p < pe; p += strlen(p) + 1) {
+		from0 = from;
+		from = NULL;
+		if (p[0] == '<') {
+			if (mailestd_update_files_path(_this, p + 1, frompath,
+			    sizeof(frompath)))
+				from = frompath;
+			continue;
 		}
-		if (bn[i] != '\0') {
-			if (_this->suffix == NULL)
-				continue;
-			for (j = 0; !isnull(_this->suffix[j]); j++) {
-				if (strcmp(bn + i, _this->suffix[j]) == 0)
-					break;
-			}
-			if (isnull(_this->suffix[j]))
+		if (!mailestd_update_files_path(_this, p, path, sizeof(path)))
+			continue;
+		name = strrchr(path, '/') + 1;
+		if (mailestd_is_mboxname(_this, name, strlen(name))) {
+			/* read the appended messages */
+			if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) ||
+			    (end = mailestd_mbox_end(_this, path, &lastmsg))
+			    == st.st_size)
 				continue;
+			memset(&ent, 0, sizeof(ent));
+			ent.mtime = st.st_mtime;
+			ent.size = st.st_size;
+			ent.ino = st.st_ino;
+			mailestd_schedule_mbox_scan(_this, ctx, path, &ent,
+			    (st.st_size < end)? 0 : end, lastmsg,
+			    (st.st_size < end), _this->curr_time);
+			continue;
+		}
+		if (!(mailestd_is_maildir_dir(_this, path, name - path - 1)
+		    ? mailestd_is_maildir_msgname(name, &seq)
+		    : mailestd_is_msgname(_this, name, &seq))) {
+			mailestd_log(LOG_DEBUG, "%s is not a message", path);
+			continue;
 		}
-		msg0.path = ftse->fts_path;
+		msg0.path = path;
 		msg = RB_FIND(rfc822_tree, &_this->root, &msg0);
-		if (msg == NULL) {
-			msg = xcalloc(1, sizeof(struct rfc822));
-			msg->path = xstrdup(ftse->fts_path);
-			RB_INSERT(rfc822_tree, &_this->root, msg);
-			strlcpy(uri + 7, ftse->fts_path, sizeof(uri) - 7);
-			if (!mailestd_is_db_sync_done(_this) &&
-			    mailestd_db_open_rd(_this) != NULL &&
-			    (db_id = est_db_uri_to_id(_this->db, uri)) != -1 &&
-			    (doc = est_db_get_doc(_this->db, db_id,
-				    ESTGDNOKWD)) != NULL) {
-				strptime(est_doc_attr(doc, ESTDATTRMDATE),
-				    MAILESTD_TIMEFMT, &tm);
-				msg->db_id = db_id;
-				msg->mtime = timegm(&tm);
-				msg->size = strtonum(est_doc_attr(doc,
-				    ESTDATTRSIZE), 0, INT64_MAX, &errstr);
-				est_doc_delete(doc);
+		if (from0 != NULL) {
+			msg0.path = (char *)from0;
+			if ((msgf = RB_FIND(rfc822_tree, &_this->root, &msg0))
+			    == NULL)
+				/* not known */;
+			else if (msg == NULL && !msgf->ontask) {
+				/* keep the document, only the path changes */
+				mailestd_msg_move(_this, msgf, path);
+				msg = msgf;
+			} else if (stat(from0, &st) != 0) {
+				delete++;
+				mailestd_remove(_this, ctx, msgf);
 			}
 		}
-		if (msg->db_id == 0 ||
-		    msg->mtime != ftse->fts_statp->st_mtime ||
-		    msg->size != ftse->fts_statp->st_size)
-			needupdate = true;
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+			memset(&ent, 0, sizeof(ent));
+			ent.mtime = st.st_mtime;
+			ent.size = st.st_size;
+			ent.ino = st.st_ino;
+			if (mailestd_gather_file(_this, ctx, _this->curr_time,
+			    msg, path, &ent))
+				update++;
+		} else if (msg != NULL) {
+			delete++;
+			mailestd_remove(_this, ctx, msg);
+		}
+	}
+	mailestd_log(LOG_DEBUG, "Updating files (Remove: %d Update: %d)",
+	    delete, update);
 
-		msg->fstime = curr_time;
-		msg->mtime = ftse->fts_statp->st_mtime;
-		msg->size = ftse->fts_statp->st_size;
-		if (needupdate) {
-			update++;
-			if (!msg->ontask) {
-				mailestd_schedule_draft(_this, ctx, msg);
-				if (ctx != NULL)
-					ctx->puts++;
+	if (_this->dbworker.suspend) {
+		strlcpy(ctx->errmsg, "database tasks are suspended",
+		    sizeof(ctx->errmsg));
+		mailestd_gather_inform(_this, NULL, ctx);
+	} else
+		mailestd_gather_inform(_this, (struct task *)task, ctx);
+}
+
+/*
+ * Read the mbox from "start" to find the messages, on the scanner.  Only
+ * the appended part is read if the previous end is still a boundary of
+ * the messages, or from the last message if it's still a boundary since
+ * the message may be being written.  Otherwise, the mbox is read from the
+ * beginning.
+ */
+static void
+mailestd_mbox_scan(struct mailestd *_this, struct task_mbox *task)
+{
+	int		 fd;
+	ssize_t		 n;
+	size_t		 len = 0, i = 0;
+	off_t		 pos, last = 0;
+	char		*buf = NULL, *p;
+	struct stat	 st;
+	bool		 bol = true, eof = false;
+
+	MAILESTD_ASSERT(_thread_self() == _this->scanworker.thread);
+	if ((fd = open(task->path, O_RDONLY)) == -1) {
+		if (errno != ENOENT)
+			mailestd_log(LOG_WARNING, "open(%s): %m", task->path);
+		task->scanerr = true;
+		goto out;
+	}
+	if (fstat(fd, &st) == -1) {
+		mailestd_log(LOG_WARNING, "fstat(%s): %m", task->path);
+		task->scanerr = true;
+		goto out;
+	}
+	/*
+	 * The previous end must be followed by the "From " line.  Otherwise
+	 * the last message may have been written further, then read from it.
+	 */
+	if (task->start > 0 &&
+	    !mailestd_mbox_boundary(fd, task->start, st.st_size)) {
+		if (task->lastmsg > 0 && task->lastmsg < task->start &&
+		    mailestd_mbox_boundary(fd, task->lastmsg, st.st_size)) {
+			mailestd_log(LOG_DEBUG, "%s: the last message is "
+			    "changed, read from it", task->path);
+			task->start = task->lastmsg;
+		} else {
+			mailestd_log(LOG_DEBUG, "%s is modified, read all",
+			    task->path);
+			task->start = 0;
+			task->full = true;
+		}
+	}
+	if (lseek(fd, task->start, SEEK_SET) == -1) {
+		mailestd_log(LOG_WARNING, "lseek(%s): %m", task->path);
+		task->scanerr = true;
+		goto out;
+	}
+	buf = xreallocarray(NULL, MAILESTD_MBOX_READSIZ, 1);
+	pos = task->start;	/* offset of buf[0] */
+	for (;;) {
+		if (len - i < 5 && !eof) {
+			/* keep the rest to see "From " over the buffers */
+			memmove(buf, buf + i, len - i);
+			pos += i;
+			len -= i;
+			i = 0;
+			/* don't read beyond the size, it may be appended */
+			if ((n = read(fd, buf + len, MINIMUM(
+			    MAILESTD_MBOX_READSIZ - len,
+			    (size_t)(st.st_size - pos - len)))) == -1) {
+				mailestd_log(LOG_WARNING, "read(%s): %m",
+				    task->path);
+				task->scanerr = true;
+				goto out;
 			}
+			if (n == 0)
+				eof = true;
+			len += n;
+			continue;
+		}
+		if (i >= len)
+			break;
+		if (bol && len - i >= 5 && strncmp(buf + i, "From ", 5) == 0) {
+			if ((task->noffs % 1024) == 0)
+				task->offs = xreallocarray(task->offs,
+				    task->noffs + 1024, sizeof(off_t));
+			task->offs[task->noffs++] = pos + i;
+		}
+		if ((p = memchr(buf + i, '\n', len - i)) == NULL) {
+			i = len;
+			bol = false;
+		} else {
+			i = p - buf + 1;
+			bol = true;
+			last = pos + i;
+		}
+	}
+	/* the last line is being written if it doesn't end with LF */
+	while (task->noffs > 0 && task->offs[task->noffs - 1] >= last)
+		task->noffs--;
+	task->end = last;
+out:
+	free(buf);
+	if (fd >= 0)
+		close(fd);
+
+	task->type = MAILESTD_TASK_MBOX_APPLY;
+	task->highprio = false;
+	task_worker_add_task(&_this->dbworker, (struct task *)task);
+}
+
+/*
+ * Add the messages found in the mbox, on the dbworker.  The message is
+ * named "<mbox>#<offset>,<length>".  The range of the existing messages is
+ * not changed before the offset read from, the messages after it which are
+ * not found are removed.
+ */
+static void
+mailestd_mbox_apply(struct mailestd *_this, struct task_mbox *task)
+{
+	int		 i, lprefix, update = 0, delete = 0;
+	off_t		 len, off;
+	char		 path[PATH_MAX];
+	struct gather	*ctx;
+	struct rfc822	*msg, *msgt, msg0;
+	struct walk_ent	 ent;
+
+	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
+	ctx = mailestd_get_gather(_this, task->gather_id);
+	lprefix = snprintf(path, sizeof(path), "%s#", task->path);
+	if (lprefix < 0 || lprefix >= (int)sizeof(path))
+		goto out;
+	if (!task->scanerr) {
+		/* forget the scan time, the found messages are marked again */
+		msg0.path = path;
+		for (msg = RB_NFIND(rfc822_tree, &_this->root, &msg0);
+		    msg != NULL && strncmp(msg->path, path, lprefix) == 0;
+		    msg = RB_NEXT(rfc822_tree, &_this->root, msg)) {
+			if (mailestd_is_mbox_msg(_this, msg->path, NULL, &off,
+			    NULL) && off >= task->start)
+				msg->fstime = 0;
+		}
+	}
+	for (i = 0; i < task->noffs; i++) {
+		len = ((i + 1 < task->noffs)? task->offs[i + 1] : task->end) -
+		    task->offs[i];
+		if (snprintf(path + lprefix, sizeof(path) - lprefix,
+		    "%lld,%lld", (long long)task->offs[i], (long long)len) >=
+		    (int)sizeof(path) - lprefix)
+			continue;
+		msg0.path = path;
+		msg = RB_FIND(rfc822_tree, &_this->root, &msg0);
+		memset(&ent, 0, sizeof(ent));
+		ent.mtime = task->mtime;
+		ent.size = len;
+		ent.ino = task->ino;
+		if (mailestd_gather_file(_this, ctx, task->fstime, msg, path,
+		    &ent))
+			update++;
+	}
+	/*
+	 * Before the database cache is loaded, the messages only in the
+	 * database are unknown.  Keep them until the next full read.
+	 */
+	if (!task->scanerr && mailestd_is_db_sync_done(_this)) {
+		path[lprefix] = '\0';
+		msg0.path = path;
+		for (msg = RB_NFIND(rfc822_tree, &_this->root, &msg0);
+		    msg != NULL; msg = msgt) {
+			msgt = RB_NEXT(rfc822_tree, &_this->root, msg);
+			if (strncmp(msg->path, path, lprefix) != 0)
+				break;
+			if (msg->fstime != 0 || !mailestd_is_mbox_msg(_this,
+			    msg->path, NULL, &off, NULL) || off < task->start)
+				continue;
+			delete++;
+			mailestd_remove(_this, ctx, msg);
+		}
+	}
+	mailestd_log(LOG_DEBUG, "Read %s from %lld (Found: %d Remove: %d "
+	    "Update: %d)", task->path, (long long)task->start, task->noffs,
+	    delete, update);
+out:
+	free(task->offs);
+	task->offs = NULL;
+	if (ctx != NULL)
+		mailestd_gather_inform(_this, (struct task *)task, ctx);
+}
+
+/*
+ * The end of the messages of the mbox known in the tree.  The start of the
+ * last message is stored in "lastp".
+ */
+static off_t
+mailestd_mbox_end(struct mailestd *_this, const char *path, off_t *lastp)
+{
+	int		 lprefix;
+	off_t		 off, len, end = 0;
+	char		 prefix[PATH_MAX];
+	struct rfc822	*msg, msg0;
+
+	*lastp = 0;
+	lprefix = snprintf(prefix, sizeof(prefix), "%s#", path);
+	if (lprefix < 0 || lprefix >= (int)sizeof(prefix))
+		return (0);
+	msg0.path = prefix;
+	for (msg = RB_NFIND(rfc822_tree, &_this->root, &msg0); msg != NULL &&
+	    strncmp(msg->path, prefix, lprefix) == 0;
+	    msg = RB_NEXT(rfc822_tree, &_this->root, msg)) {
+		if (mailestd_is_mbox_msg(_this, msg->path, NULL, &off, &len) &&
+		    off + len > end) {
+			end = off + len;
+			*lastp = off;
+		}
+	}
+
+	return (end);
+}
+
+/* whether the "From " line starts at "off" following a LF */
+static bool
+mailestd_mbox_boundary(int fd, off_t off, off_t size)
+{
+	char	 head[6];
+
+	if (off <= 0 || off > size ||
+	    pread(fd, head, sizeof(head), off - 1) != sizeof(head) ||
+	    head[0] != '\n' || strncmp(head + 1, "From ", 5) != 0)
+		return (false);
+
+	return (true);
+}
+
+/*
+ * List the messages of the folder on the scanner.  The result is passed to
+ * the dbworker to apply to the messages by reusing the task.
+ */
+static void
+mailestd_scan(struct mailestd *_this, struct task_gather *task)
+{
+	char		 rdir[PATH_MAX], buf[PATH_MAX];
+	const char	*folder = task->folder;
+	time_t		 scan_time;
+	struct scan_dir	*dir;
+
+	MAILESTD_ASSERT(_thread_self() == _this->scanworker.thread);
+	if (folder[0] == '/')
+		strlcpy(rdir, folder, sizeof(rdir));
+	else {
+		strlcpy(rdir, _this->maildir, sizeof(rdir));
+		strlcat(rdir, "/", sizeof(rdir));
+		strlcat(rdir, folder, sizeof(rdir));
+	}
+	mailestd_log(LOG_DEBUG, "Gathering %s ...", mailestd_folder_name(
+	    _this, rdir, buf, sizeof(buf)));
+	time(&scan_time);
+	if (mailestd_walk(_this, task, scan_time, rdir, NULL) < 0)
+		task->scanerr = true;
+	else {
+		mailestd_dircache_prune(_this, rdir, scan_time);
+		if (TAILQ_EMPTY(&task->dirs)) {
+			/* removed, let the dbworker remove the messages */
+			dir = xcalloc(1, sizeof(struct scan_dir));
+			dir->path = xstrdup(rdir);
+			dir->missing = true;
+			TAILQ_INSERT_TAIL(&task->dirs, dir, queue);
 		}
-	} while ((ftse = fts_read(fts)) != NULL);
+	}
 
-	return (update);
+	task->type = MAILESTD_TASK_GATHER_APPLY;
+	task->highprio = false;	/* let the searches interrupt */
+	task_worker_add_task(&_this->dbworker, (struct task *)task);
 }
 
+/*
+ * Walk the directory and its subdirectories.  Only the entries which may be
+ * messages are stat()ed.  Returns -1 if the directory couldn't be read.
+ */
 static int
-mailestd_fts_compar(const FTSENT **a, const FTSENT **b)
+mailestd_walk(struct mailestd *_this, struct task_gather *task,
+    time_t scan_time, const char *path, struct walk_anc *anc)
+{
+	int		 fd, i, nents = 0, nmsgs = 0;
+	size_t		 lname, lpath, namesiz = 0, namecap = 0;
+	char		*names = NULL, cpath[PATH_MAX];
+	DIR		*dp;
+	struct dirent	*de;
+	struct stat	 st;
+	struct walk_ent	*ents = NULL, *ent;
+	struct walk_anc	 anc0, *ance;
+	struct folder	*fld, *fldt;
+	struct folder_tree
+			 subdirs;
+	struct scan_dir	*dir;
+	bool		 msgdir;
+
+	RB_INIT(&subdirs);
+	if ((fd = open(path, O_RDONLY | O_DIRECTORY)) == -1) {
+		if (errno == ENOENT || errno == ENOTDIR)
+			return (0);
+		mailestd_log(LOG_WARNING, "open(%s): %m", path);
+		return (-1);
+	}
+	if (fstat(fd, &st) == -1) {
+		mailestd_log(LOG_WARNING, "fstat(%s): %m", path);
+		close(fd);
+		return (-1);
+	}
+	/* the symbolic links are followed, avoid the loop */
+	for (ance = anc; ance != NULL; ance = ance->parent) {
+		if (ance->dev == st.st_dev && ance->ino == st.st_ino) {
+			close(fd);
+			return (0);
+		}
+	}
+	anc0.dev = st.st_dev;
+	anc0.ino = st.st_ino;
+	anc0.parent = anc;
+
+	dir = xcalloc(1, sizeof(struct scan_dir));
+	dir->path = xstrdup(path);
+	if (mailestd_dircache_skip(_this, path, &st, scan_time, &subdirs,
+	    &dir->nmsgs)) {
+		dir->skipped = true;
+		TAILQ_INSERT_TAIL(&task->dirs, dir, queue);
+		close(fd);
+		goto subdirs;
+	}
+	if ((dp = fdopendir(fd)) == NULL) {
+		mailestd_log(LOG_WARNING, "fdopendir(%s): %m", path);
+		scan_dir_free(dir);
+		close(fd);
+		return (-1);
+	}
+	TAILQ_INSERT_TAIL(&task->dirs, dir, queue);
+	msgdir = mailestd_is_maildir_dir(_this, path, strlen(path));
+	while ((de = readdir(dp)) != NULL) {
+		if (de->d_name[0] == '.' && (de->d_name[1] == '\0' ||
+		    (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+			continue;
+		if ((nents % 256) == 0)
+			ents = xreallocarray(ents, nents + 256,
+			    sizeof(struct walk_ent));
+		ent = &ents[nents];
+		memset(ent, 0, sizeof(*ent));
+		if (msgdir)
+			ent->ismsg = mailestd_is_maildir_msgname(de->d_name,
+			    &ent->seq);
+		else if (mailestd_is_mboxname(_this, de->d_name,
+		    strlen(de->d_name))) {
+			ent->ismbox = true;
+			ent->seq = UINT_MAX;	/* sorted by the name */
+		} else
+			ent->ismsg = mailestd_is_msgname(_this, de->d_name,
+			    &ent->seq);
+		switch (de->d_type) {
+		case DT_DIR:
+			/* the files being delivered to Maildir */
+			if (_this->maildirformat &&
+			    strcmp(de->d_name, "tmp") == 0)
+				continue;
+			ent->isdir = true;
+			ent->statok = true;
+			ent->ismsg = false;
+			ent->ismbox = false;
+			break;
+		case DT_REG:
+			if (!ent->ismsg && !ent->ismbox)
+				continue;
+			ent->needstat = true;
+			break;
+		case DT_LNK:
+		case DT_UNKNOWN:
+			/* may be a directory */
+			ent->needstat = true;
+			break;
+		default:
+			continue;
+		}
+		lname = strlen(de->d_name) + 1;
+		if (namesiz + lname > namecap) {
+			namecap = MAXIMUM(namecap * 2, namesiz + lname + 4096);
+			names = xreallocarray(names, namecap, 1);
+		}
+		memcpy(names + namesiz, de->d_name, lname);
+		ent->nameoff = namesiz;
+		namesiz += lname;
+		nents++;
+	}
+	for (i = 0; i < nents; i++)
+		ents[i].name = names + ents[i].nameoff;
+
+	mailestd_walk_stat(dirfd(dp), ents, nents);
+	qsort(ents, nents, sizeof(struct walk_ent), walk_ent_compar);
+
+	for (i = 0; i < nents; i++) {
+		ent = &ents[i];
+		if (!ent->statok)
+			continue;
+		if (ent->isdir) {
+			if (strlcpy(cpath, path, sizeof(cpath)) >= sizeof(cpath)
+			    || strlcat(cpath, "/", sizeof(cpath))
+			    >= sizeof(cpath) || strlcat(cpath, ent->name,
+			    sizeof(cpath)) >= sizeof(cpath))
+				continue;
+			fld = xcalloc(1, sizeof(struct folder));
+			fld->path = xstrdup(cpath);
+			if (RB_INSERT(folder_tree, &subdirs, fld) != NULL)
+				folder_free(fld);
+			continue;
+		}
+		if (ent->ismbox) {
+			if ((dir->nmboxes % 16) == 0)
+				dir->mboxes = xreallocarray(dir->mboxes,
+				    dir->nmboxes + 16, sizeof(struct walk_ent));
+			dir->mboxes[dir->nmboxes++] = *ent;
+			continue;
+		}
+		if (!ent->ismsg)
+			continue;
+		ents[nmsgs++] = *ent;	/* keep only the messages */
+	}
+	closedir(dp);
+	dir->ents = ents;
+	dir->nents = nmsgs;
+	dir->names = names;
+	if (nmsgs > 0) {
+		dir->byname = xreallocarray(NULL, nmsgs,
+		    sizeof(struct walk_ent *));
+		for (i = 0; i < nmsgs; i++)
+			dir->byname[i] = &ents[i];
+		qsort(dir->byname, nmsgs, sizeof(struct walk_ent *),
+		    walk_ent_name_compar);
+	}
+subdirs:
+	/* the folder tree is in strcmp() order of the names */
+	lpath = strlen(path);
+	RB_FOREACH(fld, folder_tree, &subdirs) {
+		if ((dir->nsubdirs % 16) == 0)
+			dir->subdirs = xreallocarray(dir->subdirs,
+			    dir->nsubdirs + 16, sizeof(char *));
+		dir->subdirs[dir->nsubdirs++] = xstrdup(fld->path + lpath + 1);
+	}
+	if (!dir->skipped)
+		mailestd_dircache_update(_this, path, &st, nmsgs,
+		    dir->nsubdirs, dir->nmboxes, scan_time);
+	RB_FOREACH_SAFE(fld, folder_tree, &subdirs, fldt) {
+		RB_REMOVE(folder_tree, &subdirs, fld);
+		mailestd_walk(_this, task, scan_time, fld->path, &anc0);
+		folder_free(fld);
+	}
+
+	return (0);
+}
+
+/*
+ * Whether the name is a message.  A message is named by digits with one of
+ * the suffixes optionally.  "seq" is set the number for sorting.
+ */
+static bool
+mailestd_is_msgname(struct mailestd *_this, const char *name, u_int *seq)
 {
-	int	 cmp;
-	u_int	 seqa, seqb;
-	const char *errstr;
+	int		 i, j;
+	uint64_t	 num = 0;
 
-	if ((*a)->fts_parent != (*b)->fts_parent)
-		return (strcmp((*a)->fts_parent->fts_name,
-		    (*b)->fts_parent->fts_name));
+	for (i = 0; isdigit((unsigned char)name[i]); i++) {
+		if (num <= UINT_MAX)
+			num = num * 10 + (name[i] - '0');
+	}
+	*seq = (i == 0 || num >= UINT_MAX)? UINT_MAX : (u_int)num;
+	if (i == 0)
+		return (false);
+	if (name[i] == '\0')
+		return (true);
+	if (_this->suffix == NULL)
+		return (false);
+	for (j = 0; !isnull(_this->suffix[j]); j++) {
+		if (strcmp(name + i, _this->suffix[j]) == 0)
+			return (true);
+	}
+
+	return (false);
+}
+
+/* whether the directory, the first "len" bytes of "path", is in Maildir */
+static bool
+mailestd_is_maildir_dir(struct mailestd *_this, const char *path, size_t len)
+{
+	if (!_this->maildirformat || len < 4)
+		return (false);
+	return (strncmp(path + len - 4, "/cur", 4) == 0 ||
+	    strncmp(path + len - 4, "/new", 4) == 0);
+}
 
-	seqa = strtonum((*a)->fts_name, 1, UINT_MAX, &errstr);
-	if (errstr != NULL)
-		seqa = UINT_MAX;
+/* "<time>.<unique>.<host>[:2,<flags>]", use the time as the sequence */
+static bool
+mailestd_is_maildir_msgname(const char *name, u_int *seq)
+{
+	int		 i;
+	uint64_t	 num = 0;
 
-	seqb = strtonum((*b)->fts_name, 1, UINT_MAX, &errstr);
-	if (errstr != NULL)
-		seqb = UINT_MAX;
+	if (name[0] == '.')
+		return (false);
+	for (i = 0; isdigit((unsigned char)name[i]); i++) {
+		if (num <= UINT_MAX)
+			num = num * 10 + (name[i] - '0');
+	}
+	*seq = (i == 0 || num >= UINT_MAX)? UINT_MAX : (u_int)num;
 
-	cmp = (seqa - seqb);
-	if (cmp != 0)
-		return (cmp);
-	return (strcmp((*a)->fts_name, (*b)->fts_name));
+	return (true);
+}
+
+/* whether the name, the first "len" bytes, is a mbox */
+static bool
+mailestd_is_mboxname(struct mailestd *_this, const char *name, size_t len)
+{
+	int		 i;
+	size_t		 lsuffix;
+
+	if (_this->mbox_suffix == NULL)
+		return (false);
+	for (i = 0; !isnull(_this->mbox_suffix[i]); i++) {
+		lsuffix = strlen(_this->mbox_suffix[i]);
+		if (len >= lsuffix && strncmp(name + len - lsuffix,
+		    _this->mbox_suffix[i], lsuffix) == 0)
+			return (true);
+	}
+
+	return (false);
+}
+
+/*
+ * Whether the path is of a message in a mbox, "<mbox>#<offset>,<length>".
+ * The length of the path of the mbox and the range are returned.
+ */
+static bool
+mailestd_is_mbox_msg(struct mailestd *_this, const char *path, size_t *lmbox,
+    off_t *off, off_t *len)
+{
+	long long	 off0, len0;
+	const char	*ps, *pn;
+	char		*ep;
+
+	if (_this->mbox_suffix == NULL || (ps = strrchr(path, '#')) == NULL ||
+	    (pn = strrchr(path, '/')) == NULL || pn > ps)
+		return (false);
+	pn++;
+	if (!isdigit((unsigned char)ps[1]))
+		return (false);
+	errno = 0;
+	off0 = strtoll(ps + 1, &ep, 10);
+	if (*ep != ',' || !isdigit((unsigned char)ep[1]))
+		return (false);
+	len0 = strtoll(ep + 1, &ep, 10);
+	if (*ep != '\0' || errno == ERANGE)
+		return (false);
+	if (!mailestd_is_mboxname(_this, pn, ps - pn))
+		return (false);
+	if (lmbox != NULL)
+		*lmbox = ps - path;
+	if (off != NULL)
+		*off = off0;
+	if (len != NULL)
+		*len = len0;
+
+	return (true);
+}
+
+/*
+ * Return the key of the message for the URI in the database.  The name of
+ * a message in Maildir is changed by its flags and it is moved from "new"
+ * to "cur".  "<maildir>/<unique>" is used for such the message, the path
+ * is kept in ATTR_PATH.  Otherwise the path itself is the key.
+ */
+static const char *
+mailestd_msg_key(struct mailestd *_this, const char *path, char *buf,
+    size_t lbuf)
+{
+	const char	*ps;
+
+	if ((ps = strrchr(path, '/')) == NULL ||
+	    !mailestd_is_maildir_dir(_this, path, ps - path))
+		return (path);
+	ps++;
+	if ((size_t)snprintf(buf, lbuf, "%.*s/%.*s", (int)(ps - path - 5),
+	    path, (int)strcspn(ps, ":"), ps) >= lbuf)
+		return (path);
+
+	return (buf);
+}
+
+/*
+ * Find the message which is renamed to "path" in the same Maildir, which
+ * has the same unique name in "cur" or "new" but its file is gone.  The
+ * message is moved to the new path in the tree.
+ */
+static struct rfc822 *
+mailestd_maildir_renamed(struct mailestd *_this, const char *path)
+{
+	int		 i, lprefix;
+	char		 keybuf[PATH_MAX], prefix[PATH_MAX];
+	const char	*key, *ps;
+	struct rfc822	*msg, msg0;
+	struct stat	 st;
+	static const char
+			*subdirs[] = { "cur", "new" };
+
+	if ((key = mailestd_msg_key(_this, path, keybuf, sizeof(keybuf)))
+	    == path)
+		return (NULL);
+	ps = strrchr(key, '/');
+	for (i = 0; i < (int)nitems(subdirs); i++) {
+		lprefix = snprintf(prefix, sizeof(prefix), "%.*s/%s%s",
+		    (int)(ps - key), key, subdirs[i], ps);
+		if (lprefix < 0 || lprefix >= (int)sizeof(prefix))
+			continue;
+		msg0.path = prefix;
+		for (msg = RB_NFIND(rfc822_tree, &_this->root, &msg0);
+		    msg != NULL; msg = RB_NEXT(rfc822_tree, &_this->root, msg)) {
+			if (strncmp(msg->path, prefix, lprefix) != 0)
+				break;
+			if ((msg->path[lprefix] != ':' &&
+			    msg->path[lprefix] != '\0') || msg->ontask ||
+			    strcmp(msg->path, path) == 0)
+				continue;
+			if (stat(msg->path, &st) == 0 || errno != ENOENT)
+				continue;	/* not renamed */
+			mailestd_msg_move(_this, msg, path);
+			return (msg);
+		}
+	}
+
+	return (NULL);
+}
+
+/* move the message to the path in the tree, its file is renamed */
+static void
+mailestd_msg_move(struct mailestd *_this, struct rfc822 *msg,
+    const char *path)
+{
+	RB_REMOVE(rfc822_tree, &_this->root, msg);
+	free(msg->path);
+	msg->path = xstrdup(path);
+	RB_INSERT(rfc822_tree, &_this->root, msg);
+	if (msg->db_id != 0)
+		msg->renamed = true;
+	if (msg->draftfailed)
+		_this->failed_dirty = true;
+}
+
+static void
+mailestd_walk_stat0(int dfd, struct walk_ent *ents, int nents)
+{
+	int			 i;
+#ifdef STATX_BASIC_STATS
+	struct statx		 stx;
+#else
+	struct stat		 st;
+#endif
+
+	for (i = 0; i < nents; i++) {
+		if (!ents[i].needstat)
+			continue;
+#ifdef STATX_BASIC_STATS
+		/* ask only what we need, it's cheaper on some filesystems */
+		if (statx(dfd, ents[i].name, AT_NO_AUTOMOUNT,
+		    STATX_TYPE | STATX_MTIME | STATX_SIZE | STATX_INO, &stx)
+		    == -1)
+			continue;
+		ents[i].isdir = S_ISDIR(stx.stx_mode);
+		ents[i].mtime = stx.stx_mtime.tv_sec;
+		ents[i].size = stx.stx_size;
+		ents[i].ino = stx.stx_ino;
+#else
+		if (fstatat(dfd, ents[i].name, &st, 0) == -1)
+			continue;
+		ents[i].isdir = S_ISDIR(st.st_mode);
+		ents[i].mtime = st.st_mtime;
+		ents[i].size = st.st_size;
+		ents[i].ino = st.st_ino;
+#endif
+		if (!ents[i].isdir && !ents[i].ismsg && !ents[i].ismbox)
+			continue;
+		ents[i].statok = true;
+	}
+}
+
+#ifdef MAILESTD_MT
+struct walk_stat_arg {
+	int		 dfd;
+	struct walk_ent	*ents;
+	int		 nents;
+};
+
+static void *
+mailestd_walk_stat_start(void *ctx)
+{
+	struct walk_stat_arg	*arg = ctx;
+
+	mailestd_walk_stat0(arg->dfd, arg->ents, arg->nents);
+
+	return (NULL);
+}
+#endif
+
+/*
+ * stat() the entries.  Since the latency of stat() dominates on the cold
+ * cache or the network filesystems, use multiple threads for the large
+ * directories.
+ */
+static void
+mailestd_walk_stat(int dfd, struct walk_ent *ents, int nents)
+{
+#ifdef MAILESTD_MT
+	int			 i, n, slice;
+	_thread_t		 threads[MAILESTD_WALK_NTHREADS];
+	struct walk_stat_arg	 args[MAILESTD_WALK_NTHREADS];
+	bool			 started[MAILESTD_WALK_NTHREADS];
+
+	if (nents >= MAILESTD_WALK_PARALLEL) {
+		slice = (nents + MAILESTD_WALK_NTHREADS - 1) /
+		    MAILESTD_WALK_NTHREADS;
+		for (i = 0; i < MAILESTD_WALK_NTHREADS; i++) {
+			n = MINIMUM(slice, nents - i * slice);
+			args[i].dfd = dfd;
+			args[i].ents = ents + i * slice;
+			args[i].nents = MAXIMUM(n, 0);
+			started[i] = false;
+			if (i > 0 && _thread_create(&threads[i], NULL,
+			    mailestd_walk_stat_start, &args[i]) == 0)
+				started[i] = true;
+		}
+		for (i = 0; i < MAILESTD_WALK_NTHREADS; i++) {
+			if (started[i])
+				_thread_join(threads[i], NULL);
+			else
+				mailestd_walk_stat0(dfd, args[i].ents,
+				    args[i].nents);
+		}
+		return;
+	}
+#endif
+	mailestd_walk_stat0(dfd, ents, nents);
+}
+
+static int
+walk_ent_compar(const void *a0, const void *b0)
+{
+	const struct walk_ent *a = a0, *b = b0;
+
+	if (a->seq != b->seq)
+		return ((a->seq < b->seq)? -1 : 1);
+	return (strcmp(a->name, b->name));
+}
+
+static int
+walk_ent_name_compar(const void *a0, const void *b0)
+{
+	const struct walk_ent *a = *(struct walk_ent * const *)a0;
+	const struct walk_ent *b = *(struct walk_ent * const *)b0;
+
+	return (strcmp(a->name, b->name));
+}
+
+static int
+str_compar(const void *a, const void *b)
+{
+	return (strcmp(*(char * const *)a, *(char * const *)b));
+}
+
+/* for bsearch() the name in the entries */
+static int
+walk_ent_key_compar(const void *key, const void *ent)
+{
+	return (strcmp(key, ((const struct walk_ent *)ent)->name));
+}
+
+static bool
+mailestd_gather_file(struct mailestd *_this, struct gather *ctx,
+    time_t curr_time, struct rfc822 *msg, const char *path,
+    struct walk_ent *ent)
+{
+	const char	*errstr;
+	bool		 needupdate = false;
+	char		 uri[PATH_MAX + 128], keybuf[PATH_MAX];
+	struct tm	 tm;
+	ESTDOC		*doc;
+	int		 db_id;
+	time_t		 mtime = ent->mtime;
+	off_t		 size = ent->size;
+	const char	*dpath;
+
+	if (msg == NULL)
+		msg = mailestd_maildir_renamed(_this, path);
+	if (msg == NULL) {
+		msg = xcalloc(1, sizeof(struct rfc822));
+		msg->path = xstrdup(path);
+		RB_INSERT(rfc822_tree, &_this->root, msg);
+		strlcpy(uri, URIFILE, sizeof(uri));
+		strlcat(uri, mailestd_msg_key(_this, path, keybuf,
+		    sizeof(keybuf)), sizeof(uri));
+		if (!mailestd_is_db_sync_done(_this) &&
+		    mailestd_db_open_rd(_this) != NULL &&
+		    (db_id = est_db_uri_to_id(_this->db, uri)) != -1 &&
+		    (doc = est_db_get_doc(_this->db, db_id, ESTGDNOKWD))
+		    != NULL) {
+			strptime(est_doc_attr(doc, ESTDATTRMDATE),
+			    MAILESTD_TIMEFMT, &tm);
+			msg->db_id = db_id;
+			msg->mtime = timegm(&tm);
+			msg->size = strtonum(est_doc_attr(doc, ESTDATTRSIZE), 0,
+			    INT64_MAX, &errstr);
+			msg->hash = rfc822_hash_attr(doc);
+			if ((dpath = doc2path(doc)) != NULL &&
+			    strcmp(dpath, path) != 0)
+				msg->renamed = true;
+			est_doc_delete(doc);
+		}
+	}
+	if ((msg->db_id != 0 || msg->draftfailed) &&
+	    mailestd_is_mbox_msg(_this, path, NULL, NULL, NULL))
+		/* the mtime is of the mbox, the range is not changed */
+		mtime = msg->mtime;
+	if (msg->db_id == 0 || msg->mtime != mtime || msg->size != size ||
+	    msg->renamed)
+		needupdate = true;
+	if (msg->draftfailed) {
+		/* don't retry the failed draft until it's modified */
+		if (msg->mtime == mtime && msg->size == size)
+			needupdate = false;
+		else {
+			msg->draftfailed = false;
+			_this->failed_dirty = true;
+		}
+	}
+
+	/* the renamed file may be written too, then it's parsed again */
+	if (msg->renamed && (msg->mtime != mtime || msg->size != size))
+		msg->modified = true;
+	msg->fstime = curr_time;
+	msg->mtime = mtime;
+	msg->size = size;
+	msg->ino = ent->ino;
+	if (needupdate && !msg->ontask) {
+		mailestd_schedule_draft(_this, ctx, msg);
+		if (ctx != NULL)
+			ctx->puts++;
+	}
+
+	return (needupdate);
+}
+
+/*
+ * Skip the directory if it's not changed since the last gather.  Adding or
+ * removing a message always updates the mtime of the directory.  Since the
+ * subdirectories have their own mtime, they are put on "pendings" to be
+ * walked separately.
+ */
+static bool
+mailestd_dircache_skip(struct mailestd *_this, const char *path,
+    struct stat *st, time_t curr_time, struct folder_tree *pendings,
+    int *nmsgs)
+{
+	int		 ldir, nsubdirs = 0;
+	char		 dir[PATH_MAX];
+	struct dircache	*dc, *dce, dc0;
+	struct folder	*fld;
+
+	MAILESTD_ASSERT(_thread_self() == _this->scanworker.thread);
+	dc0.path = (char *)path;
+	if ((dc = RB_FIND(dircache_tree, &_this->dircache, &dc0)) == NULL)
+		return (false);
+	if (!timespeccmp(&dc->mtime, &st->st_mtim, ==) ||
+	    !timespeccmp(&dc->ctime, &st->st_ctim, ==))
+		return (false);
+	/* appending to a mbox doesn't change the directory */
+	if (dc->nmboxes > 0)
+		return (false);
+	strlcpy(dir, path, sizeof(dir));
+	if (strlcat(dir, "/", sizeof(dir)) >= sizeof(dir))
+		return (false);
+	ldir = strlen(dir);
+
+	/* all the subdirectories must be cached, or they are not walked */
+	dc0.path = dir;
+	for (dce = RB_NFIND(dircache_tree, &_this->dircache, &dc0);
+	    dce != NULL; dce = RB_NEXT(dircache_tree, &_this->dircache, dce)) {
+		if (strncmp(dce->path, dir, ldir) != 0)
+			break;
+		if (strchr(dce->path + ldir, '/') == NULL)
+			nsubdirs++;
+	}
+	if (nsubdirs != dc->nsubdirs)
+		return (false);
+
+	/* the messages are compared with the tree by mailestd_gather() */
+	*nmsgs = dc->nmsgs;
+	dc->fstime = curr_time;
+
+	for (dce = RB_NFIND(dircache_tree, &_this->dircache, &dc0);
+	    dce != NULL; dce = RB_NEXT(dircache_tree, &_this->dircache, dce)) {
+		if (strncmp(dce->path, dir, ldir) != 0)
+			break;
+		if (strchr(dce->path + ldir, '/') != NULL)
+			continue;
+		fld = xcalloc(1, sizeof(struct folder));
+		fld->path = xstrdup(dce->path);
+		if (RB_INSERT(folder_tree, pendings, fld) != NULL)
+			folder_free(fld);
+	}
+
+	return (true);
+}
+
+static void
+mailestd_dircache_update(struct mailestd *_this, const char *path,
+    struct stat *st, int nmsgs, int nsubdirs, int nmboxes, time_t curr_time)
+{
+	struct dircache	*dc, dc0;
+
+	dc0.path = (char *)path;
+	dc = RB_FIND(dircache_tree, &_this->dircache, &dc0);
+	if (st->st_mtim.tv_sec >= curr_time) {
+		/*
+		 * The directory might be changed in the same second after
+		 * reading it.  Don't cache it since we can't know that.
+		 */
+		if (dc != NULL) {
+			RB_REMOVE(dircache_tree, &_this->dircache, dc);
+			dircache_free(dc);
+		}
+		return;
+	}
+	if (dc == NULL) {
+		dc = xcalloc(1, sizeof(struct dircache));
+		dc->path = xstrdup(path);
+		RB_INSERT(dircache_tree, &_this->dircache, dc);
+	}
+	dc->mtime = st->st_mtim;
+	dc->ctime = st->st_ctim;
+	dc->nmsgs = nmsgs;
+	dc->nsubdirs = nsubdirs;
+	dc->nmboxes = nmboxes;
+	dc->fstime = curr_time;
+}
+
+/* remove the caches for the directories which are not found */
+static void
+mailestd_dircache_prune(struct mailestd *_this, const char *path,
+    time_t curr_time)
+{
+	int		 lpath;
+	struct dircache	*dc, *dct, dc0;
+
+	lpath = strlen(path);
+	dc0.path = (char *)path;
+	for (dc = RB_NFIND(dircache_tree, &_this->dircache, &dc0); dc != NULL;
+	    dc = dct) {
+		dct = RB_NEXT(dircache_tree, &_this->dircache, dc);
+		if (strncmp(dc->path, path, lpath) != 0)
+			break;
+		if (!(dc->path[lpath] == '\0' || dc->path[lpath] == '/'))
+			continue;
+		if (dc->fstime != curr_time) {
+			RB_REMOVE(dircache_tree, &_this->dircache, dc);
+			dircache_free(dc);
+		}
+	}
+}
+
+/* forget the directory to check it on the next gather */
+static void
+mailestd_dircache_invalidate(struct mailestd *_this, const char *path)
+{
+	struct dircache	*dc, dc0;
+
+	MAILESTD_ASSERT(_thread_self() == _this->scanworker.thread);
+	dc0.path = (char *)path;
+	if ((dc = RB_FIND(dircache_tree, &_this->dircache, &dc0)) != NULL) {
+		RB_REMOVE(dircache_tree, &_this->dircache, dc);
+		dircache_free(dc);
+	}
+}
+
+static void
+scan_dir_free(struct scan_dir *dir)
+{
+	int	 i;
+
+	for (i = 0; i < dir->nsubdirs; i++)
+		free(dir->subdirs[i]);
+	free(dir->subdirs);
+	free(dir->mboxes);
+	free(dir->byname);
+	free(dir->path);
+	free(dir->ents);
+	free(dir->names);
+	free(dir);
 }
 
 static void
@@ -1189,32 +2899,121 @@ mailestd_draft(struct mailestd *_this, struct rfc822 *msg)
 #ifdef HAVE_LIBESTDRAFT
 	int		 fd = -1;
 	struct stat	 st;
-	char		*msgs = NULL, buf[PATH_MAX + 128];
+	char		*map = NULL, *msgs, buf[PATH_MAX + 128], keybuf[PATH_MAX];
+	char		 file[PATH_MAX];
 	struct tm	 tm;
-
-	if ((fd = open(msg->path, O_RDONLY)) < 0) {
-		mailestd_log(LOG_WARNING, "open(%s): %m", msg->path);
+	size_t		 msgsiz, whole, mapsiz = 0, lmbox;
+	off_t		 off = 0, size = 0, mapoff;
+	bool		 hdronly, mbox, usecache;
+	uint64_t	 hash;
+	const char	*draft, *key, *fn = msg->path, *p;
+
+	if (msg->renamed && !msg->modified && msg->db_id != 0 &&
+	    !msg->bodypending) {
+		/* the content is same, update the path only */
+		msg->touchonly = true;
+		return;
+	}
+	if ((mbox = mailestd_is_mbox_msg(_this, msg->path, &lmbox, &off,
+	    &size))) {
+		strlcpy(file, msg->path, MINIMUM(lmbox + 1, sizeof(file)));
+		fn = file;
+	}
+	if ((fd = open(fn, O_RDONLY)) < 0) {
+		mailestd_log(LOG_WARNING, "open(%s): %m", fn);
 		goto on_error;
 	}
 	if (fstat(fd, &st) == -1) {
-		mailestd_log(LOG_WARNING, "fstat(%s): %m", msg->path);
+		mailestd_log(LOG_WARNING, "fstat(%s): %m", fn);
 		goto on_error;
 	}
-	if ((msgs = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FILE, fd,
-	    0)) == MAP_FAILED) {
+	if (!mbox)
+		size = st.st_size;
+	else if (off + size > st.st_size) {
+		mailestd_log(LOG_WARNING, "%s is truncated", msg->path);
+		goto on_error;
+	}
+	/* map only the window of the message, the mbox may be huge */
+	mapoff = off - off % sysconf(_SC_PAGESIZE);
+	mapsiz = size + (off - mapoff);
+	if ((map = mmap(0, mapsiz, PROT_READ, MAP_PRIVATE | MAP_FILE, fd,
+	    mapoff)) == MAP_FAILED) {
+		map = NULL;
 		mailestd_log(LOG_WARNING, "mmap(%s): %m", msg->path);
 		goto on_error;
 	}
-	msg->draft = est_doc_new_from_mime(
-	    msgs, st.st_size, NULL, ESTLANGEN, 0);
-	if (msg->draft == NULL) {
-		mailestd_log(LOG_WARNING, "est_doc_new_from_mime(%s) failed",
-		    msg->path);
+	msgs = map + (off - mapoff);
+	whole = size;
+	if (mbox) {
+		/* skip the "From " line */
+		if ((p = memchr(msgs, '\n', whole)) == NULL)
+			goto on_error;
+		whole -= p + 1 - msgs;
+		msgs = (char *)p + 1;
+	}
+	hash = rfc822_hash(msgs, whole);
+	if (_this->contenthash && msg->db_id != 0 && !msg->bodypending &&
+	    msg->hash == hash) {
+		/* content is not changed, update the mtime only */
+		msg->touchonly = true;
 		goto on_error;
 	}
-	est_doc_slim(msg->draft, MAILESTD_TRIMSIZE);
+	/*
+	 * With "headers-first", parse only the header part first to make
+	 * the message searchable by its attributes soon.  The body is
+	 * indexed later by the lower priority task.
+	 */
+	msgsiz = whole;
+	hdronly = false;
+	if (_this->headersfirst && !msg->bodypending) {
+		msgsiz = rfc822_header_length(msgs, whole);
+		if (msgsiz < whole)
+			hdronly = true;
+	}
+	/*
+	 * The same message may exist in multiple folders.  Reuse the draft
+	 * of the copy parsed in the same gather.  The copies are identified
+	 * by the hash, so only with "content-hash".  The cache is not for
+	 * the threads rebuilding the database.
+	 */
+	usecache = (_this->contenthash &&
+	    _thread_self() == _this->mainworker.thread);
+	if (usecache && (draft = mailestd_draft_cache_get(_this,
+	    msg->gather_id, hash, whole, hdronly)) != NULL)
+		msg->draft = est_doc_new_from_draft(draft);
+	else {
+		msg->draft = est_doc_new_from_mime(msgs, msgsiz, NULL,
+		    ESTLANGEN, 0);
+		if (msg->draft == NULL) {
+			mailestd_log(LOG_WARNING,
+			    "est_doc_new_from_mime(%s) failed", msg->path);
+			goto on_error;
+		}
+		est_doc_slim(msg->draft, MAILESTD_TRIMSIZE);
+		if (hdronly) {
+			snprintf(buf, sizeof(buf), "%lld", (long long)whole);
+			est_doc_add_attr(msg->draft, ESTDATTRSIZE, buf);
+			est_doc_add_attr(msg->draft, ATTR_HDRONLY, "1");
+		}
+		if (usecache)
+			mailestd_draft_cache_put(_this, hash, whole, hdronly,
+			    msg->draft);
+	}
+	if (mbox) {
+		/* the length in the name, to compare on the next gather */
+		snprintf(buf, sizeof(buf), "%lld", (long long)size);
+		est_doc_add_attr(msg->draft, ESTDATTRSIZE, buf);
+	}
+	if (_this->contenthash) {
+		snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)hash);
+		est_doc_add_attr(msg->draft, ATTR_HASH, buf);
+		msg->hash = hash;
+	}
+	key = mailestd_msg_key(_this, msg->path, keybuf, sizeof(keybuf));
+	if (key != msg->path)
+		est_doc_add_attr(msg->draft, ATTR_PATH, msg->path);
 	strlcpy(buf, URIFILE, sizeof(buf));
-	strlcat(buf, msg->path, sizeof(buf));
+	strlcat(buf, key, sizeof(buf));
 	est_doc_add_attr(msg->draft, ESTDATTRURI, buf);
 	gmtime_r(&msg->mtime, &tm);
 	strftime(buf, sizeof(buf), MAILESTD_TIMEFMT "\n", &tm);
@@ -1223,8 +3022,8 @@ mailestd_draft(struct mailestd *_this, struct rfc822 *msg)
 on_error:
 	if (fd >= 0)
 		close(fd);
-	if (msgs != NULL)
-		munmap(msgs, st.st_size);
+	if (map != NULL)
+		munmap(map, mapsiz);
 	return;
 #else
 	FILE		*fpin, *fpout;
@@ -1233,6 +3032,7 @@ on_error:
 	int		 status;
 	struct tm	 tm;
 
+	/* "mbox-suffixes" is rejected by the configuration */
 	fpout = open_memstream(&draft, &draftsiz);
 	snprintf(buf, sizeof(buf), "estcmd draft -fm %s", msg->path);
 	fpin = popen(buf, "r");
@@ -1258,6 +3058,63 @@ on_error:
 #endif
 }
 
+static const char *
+mailestd_draft_cache_get(struct mailestd *_this, uint64_t gather_id,
+    uint64_t hash, off_t size, bool hdronly)
+{
+	struct draft_cache	*cache, cache0;
+
+	MAILESTD_ASSERT(_thread_self() == _this->mainworker.thread);
+	if (_this->draft_cache_gather != gather_id) {
+		/* a new gather, the copies are looked for in a gather */
+		mailestd_draft_cache_clear(_this);
+		_this->draft_cache_gather = gather_id;
+	}
+	cache0.hash = hash;
+	cache0.size = size;
+	cache0.hdronly = hdronly;
+	if ((cache = RB_FIND(draft_cache_tree, &_this->draft_cache, &cache0))
+	    == NULL)
+		return (NULL);
+
+	return (cache->draft);
+}
+
+static void
+mailestd_draft_cache_put(struct mailestd *_this, uint64_t hash, off_t size,
+    bool hdronly, ESTDOC *doc)
+{
+	struct draft_cache	*cache;
+
+	MAILESTD_ASSERT(_thread_self() == _this->mainworker.thread);
+	if (_this->draft_cache_siz >= MAILESTD_DRAFTCACHE_SIZ)
+		return;
+	cache = xcalloc(1, sizeof(struct draft_cache));
+	cache->hash = hash;
+	cache->size = size;
+	cache->hdronly = hdronly;
+	cache->draft = est_doc_dump_draft(doc);
+	if (RB_INSERT(draft_cache_tree, &_this->draft_cache, cache) != NULL) {
+		free(cache->draft);
+		free(cache);
+		return;
+	}
+	_this->draft_cache_siz += strlen(cache->draft);
+}
+
+static void
+mailestd_draft_cache_clear(struct mailestd *_this)
+{
+	struct draft_cache	*cache, *cachet;
+
+	RB_FOREACH_SAFE(cache, draft_cache_tree, &_this->draft_cache, cachet) {
+		RB_REMOVE(draft_cache_tree, &_this->draft_cache, cache);
+		free(cache->draft);
+		free(cache);
+	}
+	_this->draft_cache_siz = 0;
+}
+
 static void
 mailestd_putdb(struct mailestd *_this, struct rfc822 *msg)
 {
@@ -1267,8 +3124,13 @@ mailestd_putdb(struct mailestd *_this, struct rfc822 *msg)
 	MAILESTD_ASSERT(msg->draft != NULL);
 	MAILESTD_ASSERT(_this->db != NULL);
 
-	if (est_db_put_doc(_this->db, msg->draft, 0)) {
+	/* clean the old document from the index in flushing */
+	if (est_db_put_doc(_this->db, msg->draft, ESTPDCLEAN)) {
+		/* the URI of the old document might be different */
+		if (msg->db_id != 0 && msg->db_id != est_doc_id(msg->draft))
+			est_db_out_doc(_this->db, msg->db_id, ESTODCLEAN);
 		msg->db_id = est_doc_id(msg->draft);
+		msg->renamed = msg->modified = false;
 		if (debug > 2)
 			mailestd_log(LOG_DEBUG, "put %s successfully.  id=%d",
 			    msg->path, msg->db_id);
@@ -1279,8 +3141,86 @@ mailestd_putdb(struct mailestd *_this, struct rfc822 *msg)
 		mailestd_db_error(_this);
 	}
 
-	est_doc_delete(msg->draft);
-	msg->draft = NULL;
+	est_doc_delete(msg->draft);
+	msg->draft = NULL;
+}
+
+/*
+ * Update the mtime and the path of the document in the database.  Returns
+ * false if the document is not found, then the message must be put again.
+ */
+static bool
+mailestd_putdb_mdate(struct mailestd *_this, struct rfc822 *msg)
+{
+	int		 id;
+	ESTDOC		*doc;
+	struct tm	 tm;
+	char		 buf[80], uri[PATH_MAX + 128], keybuf[PATH_MAX];
+	const char	*key = NULL, *olduri;
+	bool		 rekey = false;
+
+	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
+	MAILESTD_ASSERT(_this->db != NULL);
+
+	if ((doc = est_db_get_doc(_this->db, msg->db_id, ESTGDNOTEXT))
+	    == NULL)
+		goto on_error;
+	if (msg->renamed) {
+		key = mailestd_msg_key(_this, msg->path, keybuf,
+		    sizeof(keybuf));
+		strlcpy(uri, URIFILE, sizeof(uri));
+		strlcat(uri, key, sizeof(uri));
+		if ((olduri = est_doc_attr(doc, ESTDATTRURI)) == NULL ||
+		    strcmp(olduri, uri) != 0) {
+			/*
+			 * The URI can't be edited.  Put the document with
+			 * its text again instead of parsing the file.
+			 */
+			est_doc_delete(doc);
+			if ((doc = est_db_get_doc(_this->db, msg->db_id, 0))
+			    == NULL)
+				goto on_error;
+			rekey = true;
+		}
+	}
+	gmtime_r(&msg->mtime, &tm);
+	strftime(buf, sizeof(buf), MAILESTD_TIMEFMT "\n", &tm);
+	est_doc_add_attr(doc, ESTDATTRMDATE, buf);
+	if (msg->renamed) {
+		est_doc_add_attr(doc, ESTDATTRURI, uri);
+		est_doc_add_attr(doc, ATTR_PATH,
+		    (key != msg->path)? msg->path : NULL);
+		msg->renamed = msg->modified = false;
+	}
+	if (rekey) {
+		id = msg->db_id;
+		if (!est_db_put_doc(_this->db, doc, ESTPDCLEAN)) {
+			mailestd_log(LOG_WARNING, "putting %s failed: %s",
+			    msg->path, est_err_msg(est_db_error(_this->db)));
+			mailestd_db_error(_this);
+		} else {
+			msg->db_id = est_doc_id(doc);
+			est_db_out_doc(_this->db, id, ESTODCLEAN);
+			if (debug > 2)
+				mailestd_log(LOG_DEBUG, "moved %s.  id=%d",
+				    msg->path, msg->db_id);
+		}
+	} else if (!est_db_edit_doc(_this->db, doc)) {
+		mailestd_log(LOG_WARNING, "updating mtime of %s failed: %s",
+		    msg->path, est_err_msg(est_db_error(_this->db)));
+		mailestd_db_error(_this);
+	} else if (debug > 2)
+		mailestd_log(LOG_DEBUG, "touched %s.  id=%d", msg->path,
+		    msg->db_id);
+	est_doc_delete(doc);
+	return (true);
+
+on_error:
+	mailestd_log(LOG_WARNING, "getting the document of %s failed, put "
+	    "it again: %s", msg->path, est_err_msg(est_db_error(_this->db)));
+	msg->db_id = 0;
+	msg->renamed = msg->modified = false;
+	return (false);
 }
 
 static void
@@ -1348,7 +3288,7 @@ notexist:
 	if (parid != NULL) {
 		mailestd_log(LOG_INFO,
 		    "guess %s's parent message is %s",
-		    msg->path, est_doc_attr(docpar, ESTDATTRURI) + 7);
+		    msg->path, doc2path(docpar));
 		est_doc_add_attr(doc, ATTR_PARID, parid);
 		est_db_edit_doc(_this->db, doc);
 	} else {
@@ -1374,7 +3314,7 @@ mailestd_deldb(struct mailestd *_this, struct rfc822 *msg)
 	MAILESTD_ASSERT(msg->db_id != 0);
 	MAILESTD_ASSERT(_this->db != NULL);
 
-	if (est_db_out_doc(_this->db, msg->db_id, 0)) {
+	if (est_db_out_doc(_this->db, msg->db_id, ESTODCLEAN)) {
 		if (debug > 2)
 			mailestd_log(LOG_DEBUG, "delete %s(%d) successfully",
 			    msg->path, msg->db_id);
@@ -1387,14 +3327,13 @@ mailestd_deldb(struct mailestd *_this, struct rfc822 *msg)
 }
 
 static void
-mailestd_db_smew(struct mailestd *_this, struct task_smew *smew)
+mailestd_db_smew(struct mailestd *_this, ESTDB *db, struct task_smew *smew)
 {
 	int		 i, cnt = 0, *res, rnum, lfolder;
 	const char	*msgid;
 	char		 buf[BUFSIZ], *bufp = NULL;
 	size_t		 bufsiz = 0;
 	FILE		*out;
-	ESTDB		*db;
 	ESTCOND		*cond;
 	ESTDOC		*doc;
 	struct doclist {
@@ -1410,7 +3349,7 @@ mailestd_db_smew(struct mailestd *_this, struct task_smew *smew)
 	if ((out = open_memstream(&bufp, &bufsiz)) == NULL)
 		abort();
 
-	if ((db = mailestd_db_open_rd(_this)) == NULL)
+	if (db == NULL)
 		goto out;
 
 	TAILQ_INIT(&children);
@@ -1452,8 +3391,7 @@ mailestd_db_smew(struct mailestd *_this, struct task_smew *smew)
 			 * Keep ancestors list unique.
 			 */
 			if (docc->uri == NULL)
-				docc->uri = uri2normalpath(_this,
-				    est_doc_attr(docc->doc, ESTDATTRURI));
+				docc->uri = doc2normalpath(_this, docc->doc);
 			if (lfolder > 0 &&
 			    !strncmp(docc->uri, smew->folder, lfolder) &&
 			    docc->uri[lfolder] == '/') {
@@ -1494,8 +3432,7 @@ mailestd_db_smew(struct mailestd *_this, struct task_smew *smew)
 	TAILQ_FOREACH_SAFE(doce, &ancestors, queue, doct) {
 		TAILQ_REMOVE(&ancestors, doce, queue);
 		if (doce->uri == NULL)
-			doce->uri = uri2normalpath(_this,
-			    (const char *)est_doc_attr(doce->doc, ESTDATTRURI));
+			doce->uri = doc2normalpath(_this, doce->doc);
 		fprintf(out, "%s\n", doce->uri);
 		est_doc_delete(doce->doc);
 		free(doce);
@@ -1511,23 +3448,22 @@ out:
 }
 
 static void
-mailestd_search(struct mailestd *_this, uint64_t task_id, const char *searchstr,
-    ESTCOND *cond, enum MAILESTCTL_OUTFORM outform)
+mailestd_search(struct mailestd *_this, ESTDB *db, uint64_t task_id,
+    const char *searchstr, ESTCOND *cond, enum MAILESTCTL_OUTFORM outform)
 {
 	int		 i, rnum, *res, ecode;
 	char		*bufp = NULL;
 	size_t		 bufsiz = 0;
 	ESTDOC		*doc;
 	FILE		*out;
-	const char	*uri;
+	const char	*path;
 
-	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
-	MAILESTD_ASSERT(_this->db != NULL);
+	MAILESTD_ASSERT(db != NULL);
 	if ((out = open_memstream(&bufp, &bufsiz)) == NULL)
 		abort();
-	res = est_db_search(_this->db, cond, &rnum, NULL);
+	res = est_db_search(db, cond, &rnum, NULL);
 	if (res == NULL) {
-		ecode = est_db_error(_this->db);
+		ecode = est_db_error(db);
 		mailestd_log(LOG_INFO,
 		    "Search(%s) failed: %s", searchstr, est_err_msg(ecode));
 		mailestd_schedule_inform(_this, task_id, NULL, 0);
@@ -1535,27 +3471,28 @@ mailestd_search(struct mailestd *_this, uint64_t task_id, const char *searchstr,
 		mailestd_log(LOG_INFO,
 		    "Searched(%s).  Hit %d", searchstr, rnum);
 		for (i = 0; i < rnum; i++) {
-			doc = est_db_get_doc(_this->db, res[i], ESTGDNOKWD);
+			doc = est_db_get_doc(db, res[i], ESTGDNOKWD);
 			if (doc == NULL) {
-				ecode = est_db_error(_this->db);
+				ecode = est_db_error(db);
 				mailestd_log(LOG_WARNING,
 				    "est_db_get_doc(id=%d) failed: %s",
 				    res[i], est_err_msg(ecode));
 			} else {
-				uri = est_doc_attr(doc, ESTDATTRURI);
+				if ((path = doc2path(doc)) == NULL)
+					path = URI2PATH(est_doc_attr(doc,
+					    ESTDATTRURI));
 				switch (outform) {
 				case MAILESTCTL_OUTFORM_SMEW:
 					if (is_parent_dir(
-					    _this->maildir, URI2PATH(uri)))
+					    _this->maildir, path))
 						fprintf(out, "%s\n",
-						    URI2PATH(uri) +
-						    _this->lmaildir + 1);
+						    path + _this->lmaildir + 1);
 					else
-						fprintf(out, "%s\n",
-						    URI2PATH(uri));
+						fprintf(out, "%s\n", path);
 					break;
 				case MAILESTCTL_OUTFORM_COMPAT_VU:
-					fprintf(out, "%d\t%s\n", res[i], uri);
+					fprintf(out, "%d\t" URIFILE "%s\n",
+					    res[i], path);
 					break;
 				}
 			}
@@ -1567,63 +3504,683 @@ mailestd_search(struct mailestd *_this, uint64_t task_id, const char *searchstr,
 	}
 }
 
+/* the worker to search, the dbworker if there is no search thread */
+static struct task_worker *
+mailestd_searcher(struct mailestd *_this)
+{
+	if (_this->nsearchworkers == 0)
+		return (&_this->dbworker);
+	return (&_this->searchworkers[_this->searchnext++ %
+	    _this->nsearchworkers].worker);
+}
+
+static struct search_worker *
+mailestd_search_worker(struct mailestd *_this, struct task_worker *worker)
+{
+	int	 i;
+
+	for (i = 0; i < _this->nsearchworkers; i++) {
+		if (worker == &_this->searchworkers[i].worker)
+			return (&_this->searchworkers[i]);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Search on the search thread.  The handle is opened without locking the
+ * file, and reopened when the dbworker has published its writing.
+ */
+static void
+mailestd_search_on_proc(struct mailestd *_this, struct search_worker *sw,
+    struct task *task)
+{
+	int			 ecode;
+	bool			 bulk;
+	struct task_search	*search;
+
+	MAILESTD_ASSERT(sw != NULL);
+	_thread_spin_lock(&_this->db_wait_lock);
+	if (!(bulk = _this->db_bulk))
+		_this->db_waiters++;
+	_thread_spin_unlock(&_this->db_wait_lock);
+	if (bulk) {
+		/*
+		 * Don't wait for the bulk loading, which is not synced
+		 * until it's done.  Answer nothing if it's being written.
+		 */
+		if (_thread_rwlock_tryrdlock(&_this->db_lock) != 0) {
+			if (task->type == MAILESTD_TASK_SEARCH)
+				mailestd_schedule_inform(_this, task->id,
+				    NULL, 0);
+			else if (task->type == MAILESTD_TASK_SMEW)
+				mailestd_db_smew(_this, NULL,
+				    (struct task_smew *)task);
+			return;
+		}
+	} else {
+		_thread_rwlock_rdlock(&_this->db_lock);
+		_thread_spin_lock(&_this->db_wait_lock);
+		_this->db_waiters--;
+		_thread_spin_unlock(&_this->db_wait_lock);
+	}
+
+	if (sw->db != NULL && sw->db_gen != _this->db_gen) {
+		if (!est_db_close(sw->db, &ecode))
+			mailestd_log(LOG_ERR, "Closing DB: %s",
+			    est_err_msg(ecode));
+		sw->db = NULL;
+	}
+	if (sw->db == NULL) {
+		if ((sw->db = est_db_open(_this->dbpath, ESTDBREADER |
+		    ESTDBNOLCK, &ecode)) == NULL)
+			mailestd_log(LOG_ERR, "Opening DB: %s",
+			    est_err_msg(ecode));
+		sw->db_gen = _this->db_gen;
+	}
+
+	switch (task->type) {
+	case MAILESTD_TASK_SEARCH:
+		search = (struct task_search *)task;
+		if (sw->db == NULL)
+			mailestd_schedule_inform(_this, task->id, NULL, 0);
+		else
+			mailestd_search(_this, sw->db, task->id, search->str,
+			    search->cond, search->outform);
+		break;
+	case MAILESTD_TASK_SMEW:
+		mailestd_db_smew(_this, sw->db, (struct task_smew *)task);
+		break;
+	default:
+		break;
+	}
+	_thread_rwlock_unlock(&_this->db_lock);
+}
+
+static void
+mailestd_db_guess_again(struct mailestd *_this, struct task *task)
+{
+	int		*res, i, rnum, num = 0;
+	ESTCOND		*cond;
+	ESTDOC		*doc;
+	struct rfc822	*msg, msg0;
+	char		 buf[80];
+
+	if (!_this->paridguess) {
+		snprintf(buf, sizeof(buf), "\"guess-parid\" is not enabled.\n");
+		goto out;
+	}
+	if (mailestd_db_open_rd(_this) == NULL) {
+		snprintf(buf, sizeof(buf), "Opening DB is failed");
+		goto out;
+	}
+
+	cond = est_cond_new();
+	est_cond_add_attr(cond, ATTR_PARID " " ESTOPSTREQ " notexist");
+	res = est_db_search(_this->db, cond, &rnum, NULL);
+	est_cond_delete(cond);
+	for (i = 0; i < rnum; i++) {
+		doc = est_db_get_doc(_this->db, res[i], ESTGDNOKWD);
+		if (doc == NULL)
+			continue;
+		if ((msg0.path = (char *)doc2path(doc)) == NULL)
+			msg = NULL;
+		else
+			msg = RB_FIND(rfc822_tree, &_this->root, &msg0);
+		if (msg != NULL && msg->pariddone) {
+			msg->pariddone = false;
+			_this->paridnotdone++;
+			num++;
+		}
+		est_doc_delete(doc);
+	}
+	if (num > 0)
+		snprintf(buf, sizeof(buf),
+		    "Guessing parent is scheduled for %d messages.\n", num);
+	else
+		snprintf(buf, sizeof(buf),
+		    "No message which needs to find its parent.\n");
+out:
+	mailestd_schedule_inform(_this, task->id, buf, strlen(buf));
+}
+
+/*
+ * Rebuild the database from the messages in it.  The messages are split
+ * by the folders into the shards, each is indexed into its own database
+ * by a thread, then they are merged by est_db_merge() and the result
+ * replaces the database.  The writes are held meanwhile and the searches
+ * use the current database.
+ */
+static void
+mailestd_db_rebuild(struct mailestd *_this, struct task *task)
+{
+	int			 n, nprocs, per, shard, ldir;
+	const char		*p;
+	char			 buf[80];
+	struct rfc822		*msg;
+	struct rebuild		*rb;
+	struct rebuild_item	*item;
+
+	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
+	if (_this->rebuild != NULL) {
+		snprintf(buf, sizeof(buf), "The database is being rebuilt.\n");
+		goto out;
+	}
+	if (!mailestd_is_db_sync_done(_this) || _this->db_bulk) {
+		snprintf(buf, sizeof(buf), "The database is being loaded.\n");
+		goto out;
+	}
+
+	n = 0;
+	RB_FOREACH(msg, rfc822_tree, &_this->root) {
+		if (msg->db_id != 0)
+			n++;
+	}
+	rb = xcalloc(1, sizeof(struct rebuild));
+	rb->mailestd_this = _this;
+	rb->start = _this->curr_time;
+	rb->items = xcalloc(MAXIMUM(n, 1), sizeof(struct rebuild_item));
+	nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	rb->nshards = MINIMUM(MAXIMUM(nprocs, 1), MAILESTD_REBUILD_MAXTHREADS);
+
+	/* split by the folders, the tree is in the order of the path */
+	per = (n + rb->nshards - 1) / rb->nshards;
+	shard = ldir = 0;
+	RB_FOREACH(msg, rfc822_tree, &_this->root) {
+		if (msg->db_id == 0 || (p = strrchr(msg->path, '/')) == NULL)
+			continue;
+		if (rb->nitems > 0 && rb->nitems >= per * (shard + 1) &&
+		    shard + 1 < rb->nshards && ((int)(p - msg->path) != ldir ||
+		    strncmp(msg->path, rb->items[rb->nitems - 1].path, ldir)))
+			shard++;
+		ldir = p - msg->path;
+		item = &rb->items[rb->nitems++];
+		item->path = xstrdup(msg->path);
+		item->mtime = msg->mtime;
+		item->db_id = msg->db_id;
+		item->shard = shard;
+	}
+	rb->nshards = shard + 1;
+	for (n = 0; n < rb->nshards; n++) {
+		rb->shards[n].rebuild = rb;
+		rb->shards[n].idx = n;
+	}
+
+	/* sync the database for the shards, then hold the writes */
+	mailestd_db_publish(_this);
+	_this->rebuild = rb;
+	mailestd_log(LOG_INFO, "Rebuilding DB, %d docs by %d threads",
+	    rb->nitems, rb->nshards);
+	snprintf(buf, sizeof(buf), "Rebuilding the database of %d messages "
+	    "by %d threads.\n", rb->nitems, rb->nshards);
+	mailestd_schedule_inform(_this, task->id, buf, strlen(buf));
+#ifdef MAILESTD_MT
+	if (_thread_create(&rb->thread, NULL, mailestd_rebuild_start, rb)
+	    == 0) {
+		rb->started = true;
+		return;
+	}
+#endif
+	mailestd_rebuild_start(rb);
+	return;
+out:
+	mailestd_schedule_inform(_this, task->id, buf, strlen(buf));
+}
+
+static void *
+mailestd_rebuild_start(void *ctx)
+{
+	struct rebuild	*rb = ctx;
+	int		 i;
+#ifdef MAILESTD_MT
+	_thread_t	 threads[MAILESTD_REBUILD_MAXTHREADS];
+	bool		 started[MAILESTD_REBUILD_MAXTHREADS];
+
+	for (i = 1; i < rb->nshards; i++)
+		started[i] = (_thread_create(&threads[i], NULL,
+		    mailestd_rebuild_shard_start, &rb->shards[i]) == 0);
+	mailestd_rebuild_shard(&rb->shards[0]);
+	for (i = 1; i < rb->nshards; i++) {
+		if (started[i])
+			_thread_join(threads[i], NULL);
+		else
+			mailestd_rebuild_shard(&rb->shards[i]);
+	}
+#else
+	for (i = 0; i < rb->nshards; i++)
+		mailestd_rebuild_shard(&rb->shards[i]);
+#endif
+	for (i = 0; i < rb->nshards; i++) {
+		if (rb->shards[i].error)
+			rb->error = true;
+	}
+	if (!rb->error && !rb->cancel && !mailestd_rebuild_merge(rb))
+		rb->error = true;
+	mailestd_schedule_message_dbworker(rb->mailestd_this,
+	    MAILESTD_TASK_REBUILD_DONE);
+
+	return (NULL);
+}
+
+static void *
+mailestd_rebuild_shard_start(void *ctx)
+{
+	mailestd_rebuild_shard(ctx);
+
+	return (NULL);
+}
+
+static void
+mailestd_rebuild_shard(struct rebuild_shard *shard)
+{
+	int			 i, ecode;
+	char			 path[PATH_MAX], *parid;
+	ESTDB			*db, *olddb;
+	struct rfc822		 msg;
+	struct rebuild		*rb = shard->rebuild;
+	struct rebuild_item	*item;
+	struct mailestd		*mailestd = rb->mailestd_this;
+
+	snprintf(path, sizeof(path), "%s/%s.%d", mailestd->dbpath,
+	    MAILESTD_REBUILD_DIR, shard->idx);
+	if ((db = mailestd_rebuild_db_open(mailestd, path)) == NULL) {
+		shard->error = true;
+		return;
+	}
+	est_db_set_cache_size(db, MAILESTD_DBBULKCACHESIZ / rb->nshards, -1,
+	    -1, -1);
+	/* the guessed parents are taken from the current database */
+	if ((olddb = est_db_open(mailestd->dbpath, ESTDBREADER | ESTDBNOLCK,
+	    &ecode)) == NULL)
+		mailestd_log(LOG_WARNING, "Opening DB: %s", est_err_msg(ecode));
+
+	for (i = 0; i < rb->nitems && !rb->cancel; i++) {
+		item = &rb->items[i];
+		if (item->shard != shard->idx)
+			continue;
+		memset(&msg, 0, sizeof(msg));
+		msg.path = item->path;
+		msg.mtime = item->mtime;
+		msg.bodypending = true;		/* parse the whole */
+		mailestd_draft(mailestd, &msg);
+		if (msg.draft == NULL) {
+			shard->fails++;
+			continue;
+		}
+		if (olddb != NULL && est_doc_attr(msg.draft, ATTR_PARID) == NULL
+		    && (parid = est_db_get_doc_attr(olddb, item->db_id,
+		    ATTR_PARID)) != NULL) {
+			est_doc_add_attr(msg.draft, ATTR_PARID, parid);
+			free(parid);
+		}
+		if (est_db_put_doc(db, msg.draft, 0))
+			shard->puts++;
+		else {
+			mailestd_log(LOG_WARNING, "putting %s failed: %s",
+			    item->path, est_err_msg(est_db_error(db)));
+			shard->fails++;
+		}
+		est_doc_delete(msg.draft);
+	}
+	if (olddb != NULL && !est_db_close(olddb, &ecode))
+		mailestd_log(LOG_ERR, "Closing DB: %s", est_err_msg(ecode));
+	if (!est_db_close(db, &ecode)) {
+		mailestd_log(LOG_ERR, "Closing %s: %s", path,
+		    est_err_msg(ecode));
+		shard->error = true;
+	}
+	if (debug > 0)
+		mailestd_log(LOG_DEBUG, "Rebuilt shard %d: %d docs (%d failed)",
+		    shard->idx, shard->puts, shard->fails);
+}
+
+/* merge the shards into the database to replace the current one */
+static bool
+mailestd_rebuild_merge(struct rebuild *rb)
+{
+	int		 i, ecode;
+	char		 path[PATH_MAX];
+	bool		 ok = true;
+	ESTDB		*db;
+	struct mailestd	*mailestd = rb->mailestd_this;
+
+	snprintf(path, sizeof(path), "%s/%s", mailestd->dbpath,
+	    MAILESTD_REBUILD_DIR);
+	if ((db = mailestd_rebuild_db_open(mailestd, path)) == NULL)
+		return (false);
+	est_db_add_attr_index(db, ATTR_MSGID, ESTIDXATTRSTR);
+	est_db_add_attr_index(db, ATTR_PARID, ESTIDXATTRSTR);
+	est_db_add_attr_index(db, ATTR_TITLE, ESTIDXATTRSTR);
+	for (i = 0; i < rb->nshards && ok && !rb->cancel; i++) {
+		snprintf(path, sizeof(path), "%s/%s.%d", mailestd->dbpath,
+		    MAILESTD_REBUILD_DIR, i);
+		if (!est_db_merge(db, path, 0)) {
+			mailestd_log(LOG_ERR, "est_db_merge(%s): %s", path,
+			    est_err_msg(est_db_error(db)));
+			ok = false;
+		}
+		est_rmdir_rec(path);
+	}
+	if (ok && !rb->cancel && !est_db_optimize(db, ESTOPTNOPURGE)) {
+		mailestd_log(LOG_ERR, "est_db_optimize: %s",
+		    est_err_msg(est_db_error(db)));
+		ok = false;
+	}
+	if (!est_db_close(db, &ecode)) {
+		mailestd_log(LOG_ERR, "Closing DB: %s", est_err_msg(ecode));
+		ok = false;
+	}
+
+	return (ok && !rb->cancel);
+}
+
+static ESTDB *
+mailestd_rebuild_db_open(struct mailestd *_this, const char *path)
+{
+	ESTDB	*db;
+	int	 ecode;
+
+	if ((db = est_db_open(path, ESTDBWRITER | ESTDBCREAT | ESTDBTRUNC |
+	    ESTDBHUGE, &ecode)) == NULL)
+		mailestd_log(LOG_ERR, "Opening %s: %s", path,
+		    est_err_msg(ecode));
+
+	return (db);
+}
+
+/* replace the database by the rebuilt one */
+static void
+mailestd_db_rebuild_done(struct mailestd *_this)
+{
+	int		 i, id, puts = 0, fails = 0;
+	char		 path[PATH_MAX], old[PATH_MAX], keybuf[PATH_MAX];
+	char		 uri[PATH_MAX + sizeof(URIFILE)];
+	const char	*key;
+	ESTDB		*db;
+	struct rfc822	*msg;
+	struct rebuild	*rb = _this->rebuild;
+
+	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
+	if (rb == NULL)
+		return;		/* canceled */
+#ifdef MAILESTD_MT
+	if (rb->started)
+		_thread_join(rb->thread, NULL);
+#endif
+	for (i = 0; i < rb->nshards; i++) {
+		puts += rb->shards[i].puts;
+		fails += rb->shards[i].fails;
+	}
+	if (rb->error) {
+		mailestd_log(LOG_ERR, "Rebuilding DB failed");
+		goto out;
+	}
+
+	/* the searches are kept out while replacing */
+	mailestd_db_close(_this);
+	mailestd_db_lock(_this);
+	snprintf(old, sizeof(old), "%s.old", _this->dbpath);
+	snprintf(path, sizeof(path), "%s/%s", old, MAILESTD_REBUILD_DIR);
+	if (rename(_this->dbpath, old) == -1) {
+		mailestd_log(LOG_ERR, "rename(%s, %s): %m", _this->dbpath, old);
+		mailestd_db_publish(_this);
+		goto out;
+	}
+	if (rename(path, _this->dbpath) == -1) {
+		mailestd_log(LOG_ERR, "rename(%s, %s): %m", path,
+		    _this->dbpath);
+		if (rename(old, _this->dbpath) == -1)
+			mailestd_log(LOG_ERR, "rename(%s, %s): %m", old,
+			    _this->dbpath);
+		mailestd_db_publish(_this);
+		goto out;
+	}
+	_this->db_stats.garbage = 0;
+	_this->db_stats.unoptimized = 0;
+	_this->db_compact = false;
+	mailestd_db_publish(_this);
+	est_rmdir_rec(old);
+
+	/* the documents have the new ids */
+	if ((db = mailestd_db_open_rd(_this)) != NULL) {
+		RB_FOREACH(msg, rfc822_tree, &_this->root) {
+			if (msg->db_id == 0)
+				continue;
+			key = mailestd_msg_key(_this, msg->path, keybuf,
+			    sizeof(keybuf));
+			strlcpy(uri, URIFILE, sizeof(uri));
+			strlcat(uri, key, sizeof(uri));
+			id = est_db_uri_to_id(db, uri);
+			msg->db_id = (id > 0)? id : 0;
+		}
+	}
+	mailestd_log(LOG_INFO, "Rebuilt DB %d docs (%d failed) in %d sec",
+	    puts, fails, (int)(_this->curr_time - rb->start));
+out:
+	_this->rebuild = NULL;
+	mailestd_rebuild_free(rb);
+}
+
+static void
+mailestd_db_rebuild_cancel(struct mailestd *_this)
+{
+	struct rebuild	*rb = _this->rebuild;
+
+	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
+	if (rb == NULL)
+		return;
+	mailestd_log(LOG_INFO, "Canceling the rebuild of DB");
+	rb->cancel = true;
+#ifdef MAILESTD_MT
+	if (rb->started)
+		_thread_join(rb->thread, NULL);
+#endif
+	_this->rebuild = NULL;
+	mailestd_rebuild_free(rb);
+}
+
+/* whether the task is held while rebuilding, it may change the messages */
+static bool
+mailestd_rebuild_holds(struct task *task)
+{
+	switch (task->type) {
+	case MAILESTD_TASK_STOP:
+	case MAILESTD_TASK_SUSPEND:
+	case MAILESTD_TASK_RESUME:
+	case MAILESTD_TASK_INFORM:
+	case MAILESTD_TASK_SEARCH:
+	case MAILESTD_TASK_SMEW:
+	case MAILESTD_TASK_GUESS_AGAIN:
+	case MAILESTD_TASK_FAILED:
+	case MAILESTD_TASK_FAILED_CLEAR:
+	case MAILESTD_TASK_REBUILD:
+	case MAILESTD_TASK_REBUILD_DONE:
+	case MAILESTD_TASK_STATS:
+		return (false);
+	default:
+		break;
+	}
+
+	return (true);
+}
+
+static void
+mailestd_rebuild_free(struct rebuild *rb)
+{
+	int		 i;
+	char		 path[PATH_MAX];
+	struct mailestd	*mailestd = rb->mailestd_this;
+
+	/* remove what is left by a failure */
+	for (i = 0; i < rb->nshards; i++) {
+		snprintf(path, sizeof(path), "%s/%s.%d", mailestd->dbpath,
+		    MAILESTD_REBUILD_DIR, i);
+		est_rmdir_rec(path);
+	}
+	snprintf(path, sizeof(path), "%s/%s", mailestd->dbpath,
+	    MAILESTD_REBUILD_DIR);
+	est_rmdir_rec(path);
+	for (i = 0; i < rb->nitems; i++)
+		free(rb->items[i].path);
+	free(rb->items);
+	free(rb);
+}
+
+static void
+mailestd_guess_parid(struct mailestd *_this)
+{
+	struct rfc822	*msg;
+
+	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
+	RB_FOREACH(msg, rfc822_tree, &_this->root) {
+		if (!msg->ontask && !msg->pariddone)
+			mailestd_schedule_guess_parid(_this, msg);
+	}
+}
+
+/*
+ * Remember the messages which failed to draft with the mtime and size, not
+ * to parse them again and again until they are modified.
+ */
+static void
+mailestd_failed_load(struct mailestd *_this)
+{
+	int		 n, num = 0;
+	long long	 mtime, size;
+	FILE		*fp;
+	char		 line[PATH_MAX + 64];
+	struct rfc822	*msg, msg0;
+
+	if ((fp = fopen(_this->failedfn, "r")) == NULL) {
+		if (errno != ENOENT)
+			mailestd_log(LOG_WARNING, "fopen(%s): %m",
+			    _this->failedfn);
+		return;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		n = 0;
+		if (sscanf(line, "%lld %lld %n", &mtime, &size, &n) != 2 ||
+		    line[n] != '/')
+			continue;
+		msg0.path = line + n;
+		if ((msg = RB_FIND(rfc822_tree, &_this->root, &msg0)) == NULL) {
+			msg = xcalloc(1, sizeof(struct rfc822));
+			msg->path = xstrdup(line + n);
+			msg->pariddone = true;
+			RB_INSERT(rfc822_tree, &_this->root, msg);
+		}
+		msg->mtime = mtime;
+		msg->size = size;
+		msg->draftfailed = true;
+		num++;
+	}
+	fclose(fp);
+	if (num > 0)
+		mailestd_log(LOG_INFO, "%d messages failed to draft before",
+		    num);
+}
+
 static void
-mailestd_db_guess_again(struct mailestd *_this, struct task *task)
+mailestd_failed_save(struct mailestd *_this)
 {
-	int		*res, i, rnum, num = 0;
-	ESTCOND		*cond;
-	ESTDOC		*doc;
-	struct rfc822	*msg, msg0;
-	const char	*uri;
-	char		 buf[80];
+	int		 num = 0;
+	FILE		*fp;
+	char		 tmpfn[PATH_MAX];
+	struct rfc822	*msg;
 
-	if (!_this->paridguess) {
-		snprintf(buf, sizeof(buf), "\"guess-parid\" is not enabled.\n");
-		goto out;
+	if (!_this->failed_dirty)
+		return;
+	_this->failed_dirty = false;
+	snprintf(tmpfn, sizeof(tmpfn), "%s.tmp", _this->failedfn);
+	if ((fp = fopen(tmpfn, "w")) == NULL) {
+		mailestd_log(LOG_WARNING, "fopen(%s): %m", tmpfn);
+		return;
 	}
-	if (mailestd_db_open_rd(_this) == NULL) {
-		snprintf(buf, sizeof(buf), "Opening DB is failed");
-		goto out;
+	RB_FOREACH(msg, rfc822_tree, &_this->root) {
+		if (!msg->draftfailed)
+			continue;
+		fprintf(fp, "%lld %lld %s\n", (long long)msg->mtime,
+		    (long long)msg->size, msg->path);
+		num++;
 	}
+	if (fclose(fp) != 0) {
+		mailestd_log(LOG_WARNING, "fclose(%s): %m", tmpfn);
+		unlink(tmpfn);
+		return;
+	}
+	if (num == 0) {
+		unlink(tmpfn);
+		unlink(_this->failedfn);
+	} else if (rename(tmpfn, _this->failedfn) == -1)
+		mailestd_log(LOG_WARNING, "rename(%s): %m", _this->failedfn);
+}
 
-	cond = est_cond_new();
-	est_cond_add_attr(cond, ATTR_PARID " " ESTOPSTREQ " notexist");
-	res = est_db_search(_this->db, cond, &rnum, NULL);
-	est_cond_delete(cond);
-	for (i = 0; i < rnum; i++) {
-		doc = est_db_get_doc(_this->db, res[i], ESTGDNOKWD);
-		if (doc == NULL)
-			continue;
-		uri = est_doc_attr(doc, ESTDATTRURI);
-		msg0.path = (char *)URI2PATH(uri);
-		msg = RB_FIND(rfc822_tree, &_this->root, &msg0);
-		if (msg != NULL && msg->pariddone) {
-			msg->pariddone = false;
-			_this->paridnotdone++;
+static void
+mailestd_failed_list(struct mailestd *_this, struct task *task)
+{
+	int		 num = 0;
+	FILE		*out;
+	char		*bufp = NULL;
+	size_t		 bufsiz = 0;
+	struct rfc822	*msg;
+
+	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
+	if ((out = open_memstream(&bufp, &bufsiz)) == NULL)
+		abort();
+	RB_FOREACH(msg, rfc822_tree, &_this->root) {
+		if (msg->draftfailed) {
+			fprintf(out, "%s\n", msg->path);
 			num++;
 		}
-		est_doc_delete(doc);
+	}
+	if (num == 0)
+		fprintf(out, "No message which failed to draft.\n");
+	fclose(out);
+	mailestd_schedule_inform(_this, task->id, (u_char *)bufp, bufsiz);
+	free(bufp);
+}
+
+static void
+mailestd_failed_clear(struct mailestd *_this, struct task *task)
+{
+	int		 num = 0;
+	char		 buf[80];
+	struct rfc822	*msg, *msgt;
+
+	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
+	RB_FOREACH_SAFE(msg, rfc822_tree, &_this->root, msgt) {
+		if (!msg->draftfailed || msg->ontask)
+			continue;
+		num++;
+		/* the directory must be walked to find it again */
+		mailestd_schedule_dircache_invalidate(_this, msg->path,
+		    strrchr(msg->path, '/') - msg->path);
+		if (msg->db_id == 0)
+			mailestd_failed_forget(_this, msg);
+		else {
+			msg->draftfailed = false;
+			msg->mtime = 0;		/* to be updated */
+			_this->failed_dirty = true;
+		}
 	}
 	if (num > 0)
 		snprintf(buf, sizeof(buf),
-		    "Guessing parent is scheduled for %d messages.\n", num);
+		    "Cleared %d messages.  They will be retried on the next "
+		    "update.\n", num);
 	else
 		snprintf(buf, sizeof(buf),
-		    "No message which needs to find its parent.\n");
-out:
+		    "No message which failed to draft.\n");
 	mailestd_schedule_inform(_this, task->id, buf, strlen(buf));
 }
 
 static void
-mailestd_guess_parid(struct mailestd *_this)
+mailestd_failed_forget(struct mailestd *_this, struct rfc822 *msg)
 {
-	struct rfc822	*msg;
-
-	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
-	RB_FOREACH(msg, rfc822_tree, &_this->root) {
-		if (!msg->ontask && !msg->pariddone)
-			mailestd_schedule_guess_parid(_this, msg);
-	}
+	if (msg->draftfailed)
+		_this->failed_dirty = true;
+	RB_REMOVE(rfc822_tree, &_this->root, msg);
+	rfc822_free(msg);
 }
 
 static void
@@ -1711,10 +4268,59 @@ mailestd_gather_enqueue(struct task_queue *q, struct gather *ctx,
 	task->gather_id = ctx->id;
 	ctx->folders++;
 	strlcpy(task->folder, folder, sizeof(task->folder));
+	TAILQ_INIT(&task->dirs);
 
 	TAILQ_INSERT_TAIL(q, (struct task *)task, queue);
 }
 
+static uint64_t
+mailestd_schedule_update_files(struct mailestd *_this, uint64_t gather_id,
+    const char *paths, size_t pathsiz, bool more)
+{
+	struct task_update_files	*task;
+
+	if (pathsiz > sizeof(task->paths))
+		return (0);
+	task = xcalloc(1, sizeof(struct task_update_files));
+	task->type = MAILESTD_TASK_UPDATE_FILES;
+	task->highprio = true;
+	task->gather_id = gather_id;
+	task->more = more;
+	memcpy(task->paths, paths, pathsiz);
+	if (pathsiz > 0)
+		task->paths[pathsiz - 1] = '\0';	/* make sure */
+	task->pathsiz = pathsiz;
+
+	task_worker_add_task(&_this->dbworker, (struct task *)task);
+
+	return (gather_id);
+}
+
+static uint64_t
+mailestd_schedule_mbox_scan(struct mailestd *_this, struct gather *gather,
+    const char *path, struct walk_ent *ent, off_t start, off_t lastmsg,
+    bool full, time_t fstime)
+{
+	struct task_mbox	*task;
+
+	task = xcalloc(1, sizeof(struct task_mbox));
+	task->type = MAILESTD_TASK_MBOX_SCAN;
+	task->highprio = true;
+	if (gather != NULL) {
+		task->gather_id = gather->id;
+		gather->folders++;	/* done by applying the result */
+	}
+	strlcpy(task->path, path, sizeof(task->path));
+	task->mtime = ent->mtime;
+	task->ino = ent->ino;
+	task->fstime = fstime;
+	task->start = start;
+	task->lastmsg = lastmsg;
+	task->full = full;
+
+	return (task_worker_add_task(&_this->scanworker, (struct task *)task));
+}
+
 static uint64_t
 mailestd_schedule_draft(struct mailestd *_this, struct gather *gather,
     struct rfc822 *msg)
@@ -1743,17 +4349,27 @@ mailestd_schedule_draft(struct mailestd *_this, struct gather *gather,
 static uint64_t
 mailestd_reschedule_draft(struct mailestd *_this)
 {
-	struct rfc822	*msg;
-	struct task	*task;
+	struct rfc822		*msg;
+	struct rfc822_queue	*msgq;
+	struct task		*task;
 
 	MAILESTD_ASSERT(_thread_self() == _this->dbworker.thread);
 	for (;;) {
-		msg = TAILQ_FIRST_ITEM(&_this->rfc822_pendings);
+		msgq = &_this->rfc822_pendings;
+		if (TAILQ_EMPTY(msgq))
+			/* then bodies of the messages indexed headers only */
+			msgq = &_this->rfc822_bodies;
 		task = TAILQ_FIRST_ITEM(&_this->rfc822_tasks);
-		if (msg == NULL || task == NULL)
+		if (task == NULL)
+			break;
+		if (_this->inodeorder || _this->db_bulk)
+			msg = mailestd_inodeorder_pick(_this, msgq);
+		else
+			msg = TAILQ_FIRST_ITEM(msgq);
+		if (msg == NULL)
 			break;
 		TAILQ_REMOVE(&_this->rfc822_tasks, task, queue);
-		TAILQ_REMOVE(&_this->rfc822_pendings, msg, queue);
+		TAILQ_REMOVE(msgq, msg, queue);
 		((struct task_rfc822 *)task)->msg = msg;
 		task->type = MAILESTD_TASK_RFC822_DRAFT;
 		_this->rfc822_ntask++;
@@ -1764,6 +4380,35 @@ mailestd_reschedule_draft(struct mailestd *_this)
 	return (0);
 }
 
+/*
+ * Pick the message which has the next inode number of the last one from
+ * the head of the queue, like an elevator.  The files of a directory are
+ * likely placed in the order of the inode numbers on the disk, this
+ * reduces the seeks on rotational disks.
+ */
+static struct rfc822 *
+mailestd_inodeorder_pick(struct mailestd *_this, struct rfc822_queue *msgq)
+{
+	int		 i = 0;
+	struct rfc822	*msg, *next = NULL, *lowest = NULL;
+
+	TAILQ_FOREACH(msg, msgq, queue) {
+		if (i++ >= MAILESTD_INODEORDER_WINDOW)
+			break;
+		if (lowest == NULL || msg->ino < lowest->ino)
+			lowest = msg;
+		if (msg->ino >= _this->inodeorder_last &&
+		    (next == NULL || msg->ino < next->ino))
+			next = msg;
+	}
+	if (next == NULL)
+		next = lowest;	/* wrap around */
+	if (next != NULL)
+		_this->inodeorder_last = next->ino;
+
+	return (next);
+}
+
 static uint64_t
 mailestd_schedule_putdb(struct mailestd *_this, struct task *task,
     struct rfc822 *msg)
@@ -1811,7 +4456,8 @@ mailestd_schedule_search(struct mailestd *_this, const char *searchstr,
 	task->outform = outform;
 	strlcpy(task->str, searchstr, sizeof(task->str));
 
-	return (task_worker_add_task(&_this->dbworker, (struct task *)task));
+	return (task_worker_add_task(mailestd_searcher(_this),
+	    (struct task *)task));
 }
 
 static uint64_t
@@ -1832,7 +4478,8 @@ mailestd_schedule_smew(struct mailestd *_this, const char *msgid,
 	strlcpy(task->folder, folder, sizeof(task->folder));
 	task->highprio = true;
 
-	return (task_worker_add_task(&_this->dbworker, (struct task *)task));
+	return (task_worker_add_task(mailestd_searcher(_this),
+	    (struct task *)task));
 }
 
 static uint64_t
@@ -1902,6 +4549,21 @@ mailestd_schedule_monitor(struct mailestd *_this, const char *path)
 	    (struct task *)task));
 }
 
+static uint64_t
+mailestd_schedule_dircache_invalidate(struct mailestd *_this, const char *path,
+    size_t len)
+{
+	struct task_dircache	*task;
+
+	task = xcalloc(1, sizeof(struct task_dircache));
+	task->type = MAILESTD_TASK_DIRCACHE_INVALIDATE;
+	task->highprio = true;
+	strlcpy(task->path, path, MINIMUM(len + 1, sizeof(task->path)));
+
+	return (task_worker_add_task(&_this->scanworker,
+	    (struct task *)task));
+}
+
 static uint64_t
 mailestd_schedule_guess_parid(struct mailestd *_this, struct rfc822 *msg)
 {
@@ -2075,15 +4737,26 @@ task_worker_on_proc(struct task_worker *_this)
 	struct task_dbworker_context	 dbctx;
 	struct mailestc			*ce, *ct;
 	enum MAILESTD_TASK		 task_type;
+	struct search_worker		*sw;
+	int				 ecode;
 
 	memset(&dbctx, 0, sizeof(dbctx));
 	while (!stop) {
 		_thread_mutex_lock(&_this->lock);
 		task = TAILQ_FIRST_ITEM(&_this->head);
-		if (task != NULL) {
+		if (task != NULL && thread_this == mailestd->dbworker.thread &&
+		    mailestd->rebuild != NULL) {
+			/* the tasks changing the messages wait for it */
+			TAILQ_FOREACH(task, &_this->head, queue) {
+				if (!mailestd_rebuild_holds(task))
+					break;
+			}
+			if (task != NULL)
+				TAILQ_REMOVE(&_this->head, task, queue);
+		} else if (task != NULL) {
 			if (_this->suspend &&
 			    !mailestd_is_db_sync_done(mailestd) &&
-			    task->type == MAILESTD_TASK_GATHER)
+			    task->type == MAILESTD_TASK_GATHER_APPLY)
 				/*
 				 * gathering before the first db_sync
 				 * requires the database is working.
@@ -2108,7 +4781,9 @@ task_worker_on_proc(struct task_worker *_this)
 			msg = ((struct task_rfc822 *)task)->msg;
 			MAILESTD_ASSERT(msg->draft == NULL);
 			mailestd_draft(mailestd, msg);
-			if (msg->draft == NULL)
+			if (msg->touchonly)
+				/* parid in the database is kept */;
+			else if (msg->draft == NULL)
 				/* No draft, no parid */
 				msg->pariddone = true;
 			else {
@@ -2135,12 +4810,24 @@ task_worker_on_proc(struct task_worker *_this)
 			task = NULL;	/* reused */
 			break;
 
+		case MAILESTD_TASK_SEARCH:
+		case MAILESTD_TASK_SMEW:
+			if (thread_this != mailestd->dbworker.thread) {
+				mailestd_search_on_proc(mailestd,
+				    mailestd_search_worker(mailestd, _this),
+				    task);
+				break;
+			}
+			/* FALLTHROUGH */
 		case MAILESTD_TASK_RFC822_GUESS:
 		case MAILESTD_TASK_RFC822_PUTDB:
 		case MAILESTD_TASK_RFC822_DELDB:
-		case MAILESTD_TASK_SEARCH:
-		case MAILESTD_TASK_SMEW:
 		case MAILESTD_TASK_GUESS_AGAIN:
+		case MAILESTD_TASK_FAILED:
+		case MAILESTD_TASK_FAILED_CLEAR:
+		case MAILESTD_TASK_REBUILD:
+		case MAILESTD_TASK_REBUILD_DONE:
+		case MAILESTD_TASK_STATS:
 			MAILESTD_ASSERT(thread_this ==
 			    mailestd->dbworker.thread);
 			task_worker_on_proc_db(_this, &dbctx, task);
@@ -2152,14 +4839,39 @@ task_worker_on_proc(struct task_worker *_this)
 			mailestd_db_sync(mailestd);
 			break;
 
+		case MAILESTD_TASK_UPDATE_FILES:
+			mailestd_update_files(mailestd,
+			    (struct task_update_files *)task);
+			break;
+
 		case MAILESTD_TASK_GATHER_START:
 			mailestd_gather_start(mailestd,
 			    (struct task_gather *)task);
 			break;
 
 		case MAILESTD_TASK_GATHER:
-			mailestd_gather(mailestd, (struct task_gather *)task);
-			if (!mailestd_is_db_sync_done(mailestd)) {
+			MAILESTD_ASSERT(thread_this ==
+			    mailestd->scanworker.thread);
+			mailestd_scan(mailestd, (struct task_gather *)task);
+			task = NULL;	/* reused */
+			break;
+
+		case MAILESTD_TASK_MBOX_SCAN:
+			MAILESTD_ASSERT(thread_this ==
+			    mailestd->scanworker.thread);
+			mailestd_mbox_scan(mailestd, (struct task_mbox *)task);
+			task = NULL;	/* reused */
+			break;
+
+		case MAILESTD_TASK_MBOX_APPLY:
+			mailestd_mbox_apply(mailestd, (struct task_mbox *)task);
+			break;
+
+		case MAILESTD_TASK_GATHER_APPLY:
+			if (mailestd_gather(mailestd,
+			    (struct task_gather *)task))
+				task = NULL;	/* scheduled again */
+			else if (!mailestd_is_db_sync_done(mailestd)) {
 				TAILQ_INSERT_TAIL(&mailestd->gather_pendings,
 				    task, queue);
 				task = NULL;
@@ -2174,6 +4886,11 @@ task_worker_on_proc(struct task_worker *_this)
 			stop = true;
 			if (thread_this == mailestd->dbworker.thread)
 				task_worker_on_proc_db(_this, &dbctx, task);
+			else if ((sw = mailestd_search_worker(mailestd, _this))
+			    != NULL && sw->db != NULL) {
+				est_db_close(sw->db, &ecode);
+				sw->db = NULL;
+			}
 			task_worker_stop(_this);
 			break;
 
@@ -2194,6 +4911,15 @@ task_worker_on_proc(struct task_worker *_this)
 		case MAILESTD_TASK_MONITOR_FOLDER:
 			mailestd_monitor_folder(mailestd,
 			    ((struct task_monitor *)task)->path);
+#ifdef MONITOR_INOTIFY
+			/* update the timer for polling */
+			mailestd_monitor_on_inotify(-1, EV_TIMEOUT, mailestd);
+#endif
+			break;
+
+		case MAILESTD_TASK_DIRCACHE_INVALIDATE:
+			mailestd_dircache_invalidate(mailestd,
+			    ((struct task_dircache *)task)->path);
 			break;
 
 		case MAILESTD_TASK_NONE:
@@ -2215,12 +4941,27 @@ task_worker_on_proc_db(struct task_worker *_this,
 	enum MAILESTD_TASK	 task_type;
 	struct mailestd		*mailestd = _this->mailestd_this;
 	struct task_search	*search;
+	bool			 hdronly, reput;
+	struct timespec		 now, diffts;
 
 	if (task == NULL)
 		task_type = MAILESTD_TASK_NONE;
 	else
 		task_type = task->type;
 
+	if (mailestd->db_locked && mailestd_db_waiters(mailestd) > 0) {
+		/* don't keep the searches waiting during a long writing */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timespecsub(&now, &mailestd->db_locktime, &diffts);
+		if (diffts.tv_sec * 1000 + diffts.tv_nsec / 1000000 >=
+		    MAILESTD_DBLOCK_HOLD)
+			mailestd_db_publish(mailestd);
+	} else if (mailestd->db_locked && mailestd->db_wr &&
+	    !mailestd->db_bulk &&
+	    est_db_used_cache_size(mailestd->db) > MAILESTD_DBDIRTYSIZ)
+		/* too much is written, sync it */
+		mailestd_db_publish(mailestd);
+
 	switch (task_type) {
 	default:
 		break;
@@ -2231,15 +4972,38 @@ task_worker_on_proc_db(struct task_worker *_this,
 			break;
 		ctx->puts++;
 		ctx->resche++;
-		if (msg->draft != NULL)
+		hdronly = reput = false;
+		if (msg->touchonly) {
+			msg->touchonly = false;
+			reput = !mailestd_putdb_mdate(mailestd, msg);
+		} else if (msg->draft != NULL) {
+			hdronly = (est_doc_attr(msg->draft, ATTR_HDRONLY)
+			    != NULL)? true : false;
 			mailestd_putdb(mailestd, msg);
+		} else {
+			/* remember not to retry until the file is changed */
+			msg->draftfailed = true;
+			mailestd->failed_dirty = true;
+		}
 		mailestd_gather_inform(mailestd, task, NULL);
-		msg->ontask = false;
 		TAILQ_INSERT_TAIL(&mailestd->rfc822_tasks, task, queue);
 		mailestd->rfc822_ntask--;
-		if (msg->db_id == 0) {
+		if (reput) {
+			/* keep it on task until it's parsed and put */
+			msg->gather_id = 0;
+			TAILQ_INSERT_TAIL(&mailestd->rfc822_pendings, msg,
+			    queue);
+		} else if (msg->db_id == 0 && !msg->draftfailed) {
 			RB_REMOVE(rfc822_tree, &mailestd->root, msg);
 			rfc822_free(msg);
+		} else if (hdronly) {
+			/* keep it on task until the body is indexed */
+			msg->bodypending = true;
+			msg->gather_id = 0;
+			TAILQ_INSERT_TAIL(&mailestd->rfc822_bodies, msg, queue);
+		} else {
+			msg->bodypending = false;
+			msg->ontask = false;
 		}
 		break;
 
@@ -2249,9 +5013,9 @@ task_worker_on_proc_db(struct task_worker *_this,
 			break;
 		ctx->dels++;
 		mailestd_gather_inform(mailestd, task, NULL);
-		mailestd_deldb(mailestd, msg);
-		RB_REMOVE(rfc822_tree, &mailestd->root, msg);
-		rfc822_free(msg);
+		if (msg->db_id != 0)	/* may be lost by a rebuild */
+			mailestd_deldb(mailestd, msg);
+		mailestd_failed_forget(mailestd, msg);
 		break;
 
 	case MAILESTD_TASK_RFC822_GUESS:
@@ -2269,18 +5033,39 @@ task_worker_on_proc_db(struct task_worker *_this,
 			mailestd_schedule_inform(mailestd, task->id, NULL, 0);
 			break;
 		}
-		mailestd_search(mailestd, task->id, search->str, search->cond,
-		    search->outform);
+		mailestd_search(mailestd, mailestd->db, task->id, search->str,
+		    search->cond, search->outform);
 		break;
 
 	case MAILESTD_TASK_SMEW:
-		mailestd_db_smew(mailestd, (struct task_smew *)task);
+		mailestd_db_smew(mailestd, mailestd_db_open_rd(mailestd),
+		    (struct task_smew *)task);
 		break;
 
 	case MAILESTD_TASK_GUESS_AGAIN:
 		mailestd_db_guess_again(mailestd, task);
 		break;
 
+	case MAILESTD_TASK_FAILED:
+		mailestd_failed_list(mailestd, task);
+		break;
+
+	case MAILESTD_TASK_FAILED_CLEAR:
+		mailestd_failed_clear(mailestd, task);
+		break;
+
+	case MAILESTD_TASK_REBUILD:
+		mailestd_db_rebuild(mailestd, task);
+		break;
+
+	case MAILESTD_TASK_STATS:
+		mailestd_db_stats(mailestd, task);
+		break;
+
+	case MAILESTD_TASK_REBUILD_DONE:
+		mailestd_db_rebuild_done(mailestd);
+		break;
+
 	case MAILESTD_TASK_NONE:
 		if (ctx->resche)
 			mailestd_reschedule_draft(mailestd);
@@ -2288,43 +5073,40 @@ task_worker_on_proc_db(struct task_worker *_this,
 			mailestd_guess_parid(mailestd);
 			mailestd->paridnotdone = 0;
 		}
+		mailestd_failed_save(mailestd);
 		if (mailestd->db == NULL || !mailestd->db_wr)
 			/* Keep the read only db connection */
 			break;
-		if (ctx->puts + ctx->dels > 0 &&
-		    est_db_used_cache_size(mailestd->db) > MAILESTD_DBFLUSHSIZ){
-			/*
-			 * When we wrote something, flush the DB first.  Since
-			 * closing DB takes long time.  Flush before close
-			 * to make the other tasks can interrupt.
-			 */
-			if (debug > 1) {
-				mailestd_log(LOG_DEBUG, "Flusing DB %d",
-				    est_db_used_cache_size(mailestd->db));
-				est_db_set_informer(mailestd->db,
-				    mailestd_db_informer, NULL);
-			}
-			est_db_flush(mailestd->db, MAILESTD_DBFLUSHSIZ);
-			if (debug > 1) {
-				mailestd_log(LOG_DEBUG, "Flushed DB %d",
-				    est_db_used_cache_size(mailestd->db));
-				est_db_set_informer(mailestd->db, NULL, NULL);
-			}
+		if (mailestd->db_bulk) {
+			/* the searches are degraded until it's done */
+			mailestd_db_bulk_done(mailestd);
+			break;
+		}
+		/*
+		 * Flush and optimize the DB in steps to make the other
+		 * tasks can interrupt.  Then sync the DB for the searches,
+		 * but keep it open until it becomes idle, not to open it
+		 * again for the next message.
+		 */
+		switch (mailestd_db_maintain(mailestd)) {
+		case 1:
 			return (false);		/* check the other tasks
 						   then call me again */
+		case 0:
+			mailestd_db_rest(mailestd);
+			break;
 		}
-		if (!ctx->optimized && ctx->puts + ctx->dels > 800) {
-			mailestd_log(LOG_DEBUG, "Optimizing DB");
-			est_db_optimize(mailestd->db,
-			    ESTOPTNOPURGE | ESTOPTNODBOPT);
-			mailestd_log(LOG_DEBUG, "Optimized DB");
-			ctx->optimized = true;
-			return (false);
-		}
-		/* Then close the DB */
-		/* FALLTHROUGH */
+		break;
 
 	case MAILESTD_TASK_STOP:
+		mailestd_db_rebuild_cancel(mailestd);
+		if (event_initialized(&mailestd->db_idletimer) &&
+		    evtimer_pending(&mailestd->db_idletimer, NULL))
+			evtimer_del(&mailestd->db_idletimer);
+		if (event_initialized(&mailestd->db_mainttimer) &&
+		    evtimer_pending(&mailestd->db_mainttimer, NULL))
+			evtimer_del(&mailestd->db_mainttimer);
+		mailestd_failed_save(mailestd);
 		if (mailestd->db != NULL) {
 			mailestd_log(LOG_INFO, "Closing DB");
 			if (debug > 1)
@@ -2333,6 +5115,7 @@ task_worker_on_proc_db(struct task_worker *_this,
 			mailestd_db_close(mailestd);
 			mailestd_log(LOG_INFO, "Closed DB (put=%d delete=%d)",
 			    ctx->puts, ctx->dels);
+			mailestd_db_stats_log(mailestd);
 		}
 		break;
 	}
@@ -2371,6 +5154,11 @@ static void
 mailestc_stop(struct mailestc *_this)
 {
 	MAILESTD_ASSERT(_this->sock >= 0);
+	/* terminate the list not to leave its gather */
+	if (_this->monitoring_cmd == MAILESTCTL_CMD_UPDATE_FILES &&
+	    _this->monitoring_more)
+		mailestd_schedule_update_files(_this->mailestd_this,
+		    _this->monitoring_id, "", 0, false);
 	bytebuffer_destroy(_this->wbuf);
 	event_del(&_this->evsock);
 	close(_this->sock);
@@ -2393,6 +5181,8 @@ mailestc_on_event(int fd, short evmask, void *ctx)
 	struct mailestctl_smew	*smew = (struct mailestctl_smew *)&cmd;
 	struct mailestctl_update
 				*update = (struct mailestctl_update *)&cmd;
+	struct mailestctl_update_files
+				*files = (struct mailestctl_update_files *)&cmd;
 
 	nev = EV_READ | EV_TIMEOUT;	/* next event */
 	if (evmask & EV_READ) {
@@ -2482,6 +5272,30 @@ mailestc_on_event(int fd, short evmask, void *ctx)
 				goto on_error;
 			break;
 
+		case MAILESTCTL_CMD_UPDATE_FILES:
+			if (siz < offsetof(struct mailestctl_update_files,
+			    paths)) {
+				mailestd_log(LOG_ERR, "%s(): received message "
+				    "size is too small", __func__);
+				goto on_error;
+			}
+			/* the following messages are for the same list */
+			if (_this->monitoring_cmd == MAILESTCTL_CMD_NONE) {
+				_this->monitoring_cmd =
+				    MAILESTCTL_CMD_UPDATE_FILES;
+				_this->monitoring_id =
+				    mailestd_new_id(mailestd);
+			} else if (_this->monitoring_cmd !=
+			    MAILESTCTL_CMD_UPDATE_FILES)
+				goto on_error;
+			if (mailestd_schedule_update_files(mailestd,
+			    _this->monitoring_id, files->paths, siz -
+			    offsetof(struct mailestctl_update_files, paths),
+			    files->more) == 0)
+				goto on_error;
+			_this->monitoring_more = files->more;
+			break;
+
 		case MAILESTCTL_CMD_GUESS_AGAIN:
 			_this->monitoring_cmd = MAILESTCTL_CMD_GUESS_AGAIN;
 			_this->monitoring_id =
@@ -2490,6 +5304,36 @@ mailestc_on_event(int fd, short evmask, void *ctx)
 			if (_this->monitoring_id == 0)
 				goto on_error;
 			break;
+
+		case MAILESTCTL_CMD_REBUILD:
+			_this->monitoring_cmd = MAILESTCTL_CMD_REBUILD;
+			_this->monitoring_id =
+			    mailestd_schedule_message_dbworker(mailestd,
+				MAILESTD_TASK_REBUILD);
+			if (_this->monitoring_id == 0)
+				goto on_error;
+			break;
+
+		case MAILESTCTL_CMD_FAILED:
+		case MAILESTCTL_CMD_FAILED_CLEAR:
+			_this->monitoring_cmd = cmd.command;
+			_this->monitoring_id =
+			    mailestd_schedule_message_dbworker(mailestd,
+				(cmd.command == MAILESTCTL_CMD_FAILED)
+				? MAILESTD_TASK_FAILED
+				: MAILESTD_TASK_FAILED_CLEAR);
+			if (_this->monitoring_id == 0)
+				goto on_error;
+			break;
+
+		case MAILESTCTL_CMD_STATS:
+			_this->monitoring_cmd = MAILESTCTL_CMD_STATS;
+			_this->monitoring_id =
+			    mailestd_schedule_message_dbworker(mailestd,
+				MAILESTD_TASK_STATS);
+			if (_this->monitoring_id == 0)
+				goto on_error;
+			break;
 		}
 	}
 
@@ -2592,6 +5436,10 @@ mailestc_task_inform(struct mailestc *_this, uint64_t task_id, u_char *inform,
 	case MAILESTCTL_CMD_SMEW:
 	case MAILESTCTL_CMD_SEARCH:
 	case MAILESTCTL_CMD_GUESS_AGAIN:
+	case MAILESTCTL_CMD_FAILED:
+	case MAILESTCTL_CMD_FAILED_CLEAR:
+	case MAILESTCTL_CMD_REBUILD:
+	case MAILESTCTL_CMD_STATS:
 		if (informsiz == 0) {
 			mailestc_stop(_this);
 			break;
@@ -2600,6 +5448,7 @@ mailestc_task_inform(struct mailestc *_this, uint64_t task_id, u_char *inform,
 		_this->monitoring_stop = true;
 		break;
 	case MAILESTCTL_CMD_UPDATE:
+	case MAILESTCTL_CMD_UPDATE_FILES:
 	    {
 		struct gather	*result = (struct gather *)inform;
 		bool		 del_compl, put_compl;
@@ -2642,8 +5491,13 @@ mailestd_monitor_init(struct mailestd *_this)
 #endif
 #ifdef MONITOR_INOTIFY
 	_this->monitor_in = inotify_init();
+	RB_INIT(&_this->monitors_wd);
+	RB_INIT(&_this->monitor_ops);
 #endif
 	RB_INIT(&_this->monitors);
+	RB_INIT(&_this->monitor_pends);
+	RB_INIT(&_this->monitor_polls);
+	TAILQ_INIT(&_this->monitor_watched);
 }
 
 #ifdef MAILESTD_MT
@@ -2692,7 +5546,7 @@ mailestd_monitor_start(struct mailestd *_this)
 	int		 i, ret, nkev, sock;
 	struct kevent	 kev[64];
 	struct folder	*flde;
-	struct timespec	*ts, ts0;
+	struct timespec	*ts, ts0, ts1;
 
 	_this->monitorworker.thread = _thread_self();
 	for (;;) {
@@ -2706,6 +5560,9 @@ mailestd_monitor_start(struct mailestd *_this)
 			nkev++;
 			if (mailestd_monitor_schedule(_this, &ts0) > 0)
 				ts = &ts0;
+			if (mailestd_monitor_poll(_this, &ts1) > 0 &&
+			    (ts == NULL || timespeccmp(&ts1, ts, <)))
+				ts = &ts1;
 		}
 
 		RB_FOREACH(flde, folder_tree, &_this->monitors) {
@@ -2740,60 +5597,224 @@ mailestd_monitor_start(struct mailestd *_this)
 				    EV_READ, &_this->monitorworker);
 			else if (kev[i].udata != NULL) {
 				flde = kev[i].udata;
+				clock_gettime(CLOCK_MONOTONIC, &ts0);
+				mailestd_monitor_touch(_this, flde, &ts0);
 				if ((kev[i].fflags & (NOTE_DELETE |
-				    NOTE_RENAME | NOTE_REVOKE)) != 0) {
-					close(flde->fd);
-					flde->fd = -1;
-				}
-				clock_gettime(CLOCK_MONOTONIC, &flde->mtime);
+				    NOTE_RENAME | NOTE_REVOKE)) != 0)
+					mailestd_monitor_unwatch(_this, flde);
+				mailestd_monitor_pend(_this, flde, &ts0);
+			}
+		}
+	}
+	return;
+    }
+#endif
+}
+
+#ifdef MONITOR_INOTIFY
+static void
+mailestd_monitor_on_inotify(int fd, short evmask, void *ctx)
+{
+	struct inotify_event	*inev;
+	static u_char		 buf[MAILESTD_MONITOR_INBUFSIZ]
+	    __attribute__((__aligned__(__alignof__(struct inotify_event))));
+	u_char			*p;
+	ssize_t			 siz;
+	struct mailestd *_this = ctx;
+	struct folder		*flde, fld0;
+	struct timespec		*ts = NULL, ts0, ts1, ts2, now;
+	struct timeval		 tv;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (evmask & EV_READ) {
+		if ((siz = read(_this->monitor_in, buf, sizeof(buf))) <= 0){
+			if (siz != 0) {
+				if (errno == EAGAIN || errno == EINTR)
+					return;
+				mailestd_log(LOG_ERR, "%s: read: %m", __func__);
+			}
+			mailestd_monitor_stop(_this);
+			return;
+		}
+		/* a read returns as many events as fit in the buffer */
+		for (p = buf; p + sizeof(struct inotify_event) <= buf + siz;
+		    p += sizeof(struct inotify_event) + inev->len) {
+			inev = (struct inotify_event *)p;
+			if ((inev->mask & IN_Q_OVERFLOW) != 0) {
+				/* the events are lost, check all folders */
+				mailestd_log(LOG_WARNING,
+				    "inotify event queue overflowed");
+				RB_FOREACH(flde, folder_tree, &_this->monitors)
+					mailestd_monitor_pend(_this, flde,
+					    &now);
+				continue;
+			}
+			fld0.fd = inev->wd;
+			if ((flde = RB_FIND(folder_wd_tree,
+			    &_this->monitors_wd, &fld0)) == NULL)
+				continue;	/* already removed */
+			mailestd_monitor_touch(_this, flde, &now);
+			if (inev->len > 0) {
+				/* for a file in the folder */
+				mailestd_monitor_file(_this, flde, inev, &now);
+				continue;
 			}
+			if ((inev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+			    != 0)
+				mailestd_monitor_unwatch(_this, flde);
+			mailestd_monitor_pend(_this, flde, &now);
 		}
 	}
-	return;
-    }
-#endif
+	if (mailestd_monitor_schedule(_this, &ts0) > 0)
+		ts = &ts0;
+	if (mailestd_monitor_flush(_this, &now, &ts1) > 0 &&
+	    (ts == NULL || timespeccmp(&ts1, ts, <)))
+		ts = &ts1;
+	if (mailestd_monitor_poll(_this, &ts2) > 0 &&
+	    (ts == NULL || timespeccmp(&ts2, ts, <)))
+		ts = &ts2;
+	if (ts != NULL) {
+		TIMESPEC_TO_TIMEVAL(&tv, ts);
+		event_add(&_this->monitor_intimerev, &tv);
+	}
+}
+
+/*
+ * Handle the event for a file in the folder.  The messages are updated
+ * directly without gathering the folder.  A new directory is monitored
+ * at once and gathered later.
+ */
+static void
+mailestd_monitor_file(struct mailestd *_this, struct folder *fld,
+    struct inotify_event *inev, struct timespec *now)
+{
+	u_int			 seq;
+	size_t			 lname;
+	char			 path[PATH_MAX];
+	struct folder		*nfld, fld0;
+	struct monitor_op	*op, *from = NULL, op0;
+
+	lname = strlen(inev->name);
+	if ((size_t)snprintf(path, sizeof(path), "%s/%s", fld->path,
+	    inev->name) >= sizeof(path))
+		return;
+	if ((inev->mask & IN_ISDIR) != 0) {
+		if ((inev->mask & (IN_CREATE | IN_MOVED_TO)) == 0 ||
+		    (_this->maildirformat && strcmp(inev->name, "tmp") == 0))
+			return;	/* removed one is noticed by itself */
+		if (strcmp(fld->path, _this->maildir) == 0 &&
+		    !mailestd_folder_match(_this, inev->name))
+			return;
+		mailestd_monitor_folder(_this, path);
+		fld0.path = path;
+		if ((nfld = RB_FIND(folder_tree, &_this->monitors, &fld0))
+		    != NULL)
+			mailestd_monitor_pend(_this, nfld, now);
+		return;
+	}
+	if (mailestd_is_maildir_dir(_this, path, strlen(fld->path))) {
+		if (!mailestd_is_maildir_msgname(inev->name, &seq))
+			return;
+	} else if (!mailestd_is_msgname(_this, inev->name, &seq) &&
+	    !mailestd_is_mboxname(_this, inev->name, lname))
+		return;
+
+	if ((inev->mask & IN_MOVED_TO) != 0 && _this->monitor_movefrom != NULL
+	    && _this->monitor_movefrom->cookie == inev->cookie) {
+		from = _this->monitor_movefrom;
+		_this->monitor_movefrom = NULL;
+	}
+	op0.path = path;
+	if ((op = RB_FIND(monitor_op_tree, &_this->monitor_ops, &op0))
+	    == NULL) {
+		op = xcalloc(1, sizeof(struct monitor_op));
+		op->path = xstrdup(path);
+		RB_INSERT(monitor_op_tree, &_this->monitor_ops, op);
+		if ((inev->mask & IN_CREATE) != 0)
+			op->created = true;
+	} else if ((inev->mask & IN_CREATE) == 0)
+		op->created = false;
+	op->time = *now;
+	if ((inev->mask & IN_MOVED_FROM) != 0) {
+		op->cookie = inev->cookie;
+		_this->monitor_movefrom = op;
+	}
+	if (from != NULL && from != op) {
+		/* renamed, the new one takes over the origin */
+		free(op->from);
+		if (from->from != NULL) {
+			op->from = from->from;
+			from->from = NULL;
+		} else
+			op->from = xstrdup(from->path);
+		RB_REMOVE(monitor_op_tree, &_this->monitor_ops, from);
+		monitor_op_free(from);
+	}
 }
 
-#ifdef MONITOR_INOTIFY
-static void
-mailestd_monitor_on_inotify(int fd, short evmask, void *ctx)
+/*
+ * Pass the changed files to the dbworker as "update-files".  The created
+ * files which are not closed yet are left until the monitor delay passes.
+ * The file moved out is also left for a while, since its IN_MOVED_TO may
+ * come by the next read.  Returns the number of them and "wait" is set
+ * when to flush them.
+ */
+static int
+mailestd_monitor_flush(struct mailestd *_this, struct timespec *now,
+    struct timespec *wait)
 {
-	struct inotify_event	*inev;
-	u_char			 buf[1024];
-	ssize_t			 siz;
-	struct mailestd *_this = ctx;
-	struct folder		*flde;
-	struct timespec		*ts = NULL, ts0;
-	struct timeval		 tv;
-
-	if (evmask & EV_READ) {
-		if ((siz = read(_this->monitor_in, buf, sizeof(buf))) <= 0){
-			if (siz != 0) {
-				if (errno == EAGAIN || errno == EINTR)
-					return;
-				mailestd_log(LOG_ERR, "%s: read: %m", __func__);
+	int			 pends = 0, nfiles = 0;
+	size_t			 off = 0, lpath, lfrom;
+	uint64_t		 id = 0;
+	char			 paths[MAILESTD_UPDATE_FILES_SIZ];
+	struct monitor_op	*op, *opt;
+	struct timespec		 diffts, rest, delay, movewait;
+
+	movewait.tv_sec = MAILESTD_MONITOR_MOVEWAIT / 1000;
+	movewait.tv_nsec = (MAILESTD_MONITOR_MOVEWAIT % 1000) * 1000000L;
+	RB_FOREACH_SAFE(op, monitor_op_tree, &_this->monitor_ops, opt) {
+		if (op->created || op == _this->monitor_movefrom) {
+			delay = (op->created)? _this->monitor_delay : movewait;
+			timespecsub(now, &op->time, &diffts);
+			if (timespeccmp(&diffts, &delay, <)) {
+				timespecsub(&delay, &diffts, &rest);
+				if (pends++ == 0 || timespeccmp(&rest, wait, <))
+					*wait = rest;
+				continue;
 			}
-			mailestd_monitor_stop(_this);
 		}
-		inev = (struct inotify_event *)buf;
-		RB_FOREACH(flde, folder_tree, &_this->monitors) {
-			if (flde->fd == inev->wd)
-				break;
+		if (op == _this->monitor_movefrom)
+			/* moved out since not paired */
+			_this->monitor_movefrom = NULL;
+		lpath = strlen(op->path) + 1;
+		lfrom = (op->from != NULL)? strlen(op->from) + 2 : 0;
+		if (off + lfrom + lpath > sizeof(paths)) {
+			if (id == 0)
+				id = mailestd_new_id(_this);
+			mailestd_schedule_update_files(_this, id, paths, off,
+			    true);
+			off = 0;
 		}
-		MAILESTD_ASSERT(flde != NULL);
-		if ((inev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) != 0) {
-			inotify_rm_watch(_this->monitor_in, flde->fd);
-			close(flde->fd);
-			flde->fd = -1;
+		if (op->from != NULL) {
+			paths[off] = '<';
+			memcpy(paths + off + 1, op->from, lfrom - 1);
+			off += lfrom;
 		}
-		clock_gettime(CLOCK_MONOTONIC, &flde->mtime);
+		memcpy(paths + off, op->path, lpath);
+		off += lpath;
+		nfiles++;
+		RB_REMOVE(monitor_op_tree, &_this->monitor_ops, op);
+		monitor_op_free(op);
 	}
-	if (mailestd_monitor_schedule(_this, &ts0) > 0)
-		ts = &ts0;
-	if (ts != NULL) {
-		TIMESPEC_TO_TIMEVAL(&tv, ts);
-		event_add(&_this->monitor_intimerev, &tv);
+	if (nfiles > 0) {
+		mailestd_log(LOG_DEBUG, "Updating %d files by monitor",
+		    nfiles);
+		if (id == 0)
+			id = mailestd_new_id(_this);
+		mailestd_schedule_update_files(_this, id, paths, off, false);
 	}
+
+	return (pends);
 }
 #endif
 
@@ -2801,17 +5822,28 @@ static void
 mailestd_monitor_stop(struct mailestd *_this)
 {
 	struct folder	*flde, *fldt;
+#ifdef MONITOR_INOTIFY
+	struct monitor_op
+			*ope, *opt;
+#endif
 
 	RB_FOREACH_SAFE(flde, folder_tree, &_this->monitors, fldt) {
 		RB_REMOVE(folder_tree, &_this->monitors, flde);
-#ifdef MONITOR_INOTIFY
-		inotify_rm_watch(_this->monitor_in, flde->fd);
-#endif
-		if (flde->fd >= 0)
-			close(flde->fd);
-		flde->fd = -1;
+		mailestd_monitor_unwatch(_this, flde);
+		if (flde->polled) {
+			RB_REMOVE(folder_poll_tree, &_this->monitor_polls,
+			    flde);
+			flde->polled = false;
+		}
 	}
+	while (_this->monitor_nheap > 0)
+		mailestd_monitor_unpend(_this, _this->monitor_heap[1]);
 #ifdef MONITOR_INOTIFY
+	RB_FOREACH_SAFE(ope, monitor_op_tree, &_this->monitor_ops, opt) {
+		RB_REMOVE(monitor_op_tree, &_this->monitor_ops, ope);
+		monitor_op_free(ope);
+	}
+	_this->monitor_movefrom = NULL;
 	if (event_pending(&_this->monitor_intimerev, EV_TIMEOUT, NULL))
 		event_del(&_this->monitor_intimerev);
 	close(_this->monitor_in);
@@ -2822,6 +5854,7 @@ mailestd_monitor_stop(struct mailestd *_this)
 static void
 mailestd_monitor_fini(struct mailestd *_this)
 {
+	free(_this->monitor_heap);
 #ifdef MONITOR_KQUEUE
 	free(_this->monitor_kev);
 #endif
@@ -2830,31 +5863,247 @@ mailestd_monitor_fini(struct mailestd *_this)
 static void
 mailestd_monitor_folder(struct mailestd *_this, const char *dirpath)
 {
-	int		 fd = -1;
 	char		 buf[PATH_MAX];
 	struct folder	*fld, fld0;
+	struct timespec	 now;
 
 	MAILESTD_ASSERT(_thread_self() == _this->monitorworker.thread);
 	fld0.path = (char *)dirpath;
 	if ((fld = RB_FIND(folder_tree, &_this->monitors, &fld0)) != NULL)
 		return;
+	fld = xcalloc(1, sizeof(struct folder));
+	fld->fd = -1;
+	fld->path = xstrdup(dirpath);
+	mailestd_monitor_conf(_this, fld);
+	RB_INSERT(folder_tree, &_this->monitors, fld);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!fld->pollonly && mailestd_monitor_watch(_this, fld))
+		fld->active = now;
+	else
+		mailestd_monitor_poll_add(_this, fld, &now);
+	mailestd_log(LOG_DEBUG, "Start %s %s", (fld->polled)
+	    ? "polling" : "monitoring",
+	    mailestd_folder_name(_this, dirpath, buf, sizeof(buf)));
+}
+
+/*
+ * Watch the folder.  Returns false if no more watch is available, then
+ * the folder should be polled instead.
+ */
+static bool
+mailestd_monitor_watch(struct mailestd *_this, struct folder *fld)
+{
+	int		 fd;
+
+	if (_this->monitor_watches > 0 &&
+	    _this->monitor_nwatches >= _this->monitor_watches)
+		goto exhausted;
 #ifdef MONITOR_KQUEUE
-	if ((fd = open(dirpath, O_RDONLY)) < 0)
-		return;
+	if ((fd = open(fld->path, O_RDONLY)) < 0) {
+		if (errno == EMFILE || errno == ENFILE)
+			goto exhausted;
+		mailestd_log(LOG_ERR, "%s() open(%s): %m", __func__,
+		    fld->path);
+		return (false);
+	}
 #endif
 #ifdef MONITOR_INOTIFY
+	/* the files are updated by their names */
 	if ((fd = inotify_add_watch(_this->monitor_in,
-	    dirpath, IN_CREATE | IN_DELETE | IN_DELETE_SELF |
-	    IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF)) == -1) {
-		mailestd_log(LOG_ERR, "%s() inotify_add_watch: %m", __func__);
+	    fld->path, IN_CREATE | IN_DELETE | IN_DELETE_SELF |
+	    IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF | IN_CLOSE_WRITE))
+	    == -1) {
+		if (errno == ENOSPC)
+			goto exhausted;
+		mailestd_log(LOG_ERR, "%s() inotify_add_watch(%s): %m",
+		    __func__, fld->path);
+		return (false);
 	}
 #endif
-	fld = xcalloc(1, sizeof(struct folder));
 	fld->fd = fd;
-	fld->path = xstrdup(dirpath);
-	RB_INSERT(folder_tree, &_this->monitors, fld);
-	mailestd_log(LOG_DEBUG, "Start monitoring %s",
-	    mailestd_folder_name(_this, dirpath, buf, sizeof(buf)));
+#ifdef MONITOR_INOTIFY
+	/* the same wd is returned for the same inode, keep the first */
+	if (RB_INSERT(folder_wd_tree, &_this->monitors_wd, fld) != NULL) {
+		fld->fd = -1;
+		return (true);
+	}
+#endif
+	_this->monitor_nwatches++;
+	TAILQ_INSERT_TAIL(&_this->monitor_watched, fld, watchq);
+
+	return (true);
+exhausted:
+	if (!_this->monitor_exhausted) {
+		mailestd_log(LOG_WARNING, "No more folders can be watched "
+		    "(%d watched), poll the rest", _this->monitor_nwatches);
+		_this->monitor_exhausted = true;
+	}
+	return (false);
+}
+
+static void
+mailestd_monitor_unwatch(struct mailestd *_this, struct folder *fld)
+{
+	if (fld->fd < 0)
+		return;
+#ifdef MONITOR_INOTIFY
+	/* the watch descriptor is not a file descriptor */
+	RB_REMOVE(folder_wd_tree, &_this->monitors_wd, fld);
+	inotify_rm_watch(_this->monitor_in, fld->fd);
+#else
+	close(fld->fd);
+#endif
+	fld->fd = -1;
+	_this->monitor_nwatches--;
+	TAILQ_REMOVE(&_this->monitor_watched, fld, watchq);
+}
+
+/* an event for the watched folder, keep the active ones at the tail */
+static void
+mailestd_monitor_touch(struct mailestd *_this, struct folder *fld,
+    struct timespec *now)
+{
+	fld->active = *now;
+	if (fld->fd >= 0) {
+		TAILQ_REMOVE(&_this->monitor_watched, fld, watchq);
+		TAILQ_INSERT_TAIL(&_this->monitor_watched, fld, watchq);
+	}
+}
+
+static void
+mailestd_monitor_poll_add(struct mailestd *_this, struct folder *fld,
+    struct timespec *now)
+{
+	MAILESTD_ASSERT(fld->fd < 0 && !fld->polled);
+	mailestd_monitor_stat(fld->path, &fld->dirmtime, &fld->dirctime);
+	fld->polled = true;
+	fld->pollint.tv_sec = MAILESTD_MONITOR_POLLMIN;
+	fld->pollint.tv_nsec = 0;
+	timespecadd(now, &fld->pollint, &fld->pollat);
+	RB_INSERT(folder_poll_tree, &_this->monitor_polls, fld);
+}
+
+/*
+ * Watch the polled folder which is changed.  If no watch is available,
+ * take the watch of the coldest folder when it has been inactive long.
+ */
+static bool
+mailestd_monitor_promote(struct mailestd *_this, struct folder *fld,
+    struct timespec *now)
+{
+	struct folder	*cold;
+	struct timespec	 diffts;
+
+	if (fld->pollonly)
+		return (false);
+	if (!mailestd_monitor_watch(_this, fld)) {
+		if ((cold = TAILQ_FIRST(&_this->monitor_watched)) == NULL)
+			return (false);
+		timespecsub(now, &cold->active, &diffts);
+		if (diffts.tv_sec < MAILESTD_MONITOR_COLD)
+			return (false);
+		MAILESTD_DBG((LOG_DEBUG, "COLD %s", cold->path));
+		mailestd_monitor_unwatch(_this, cold);
+		mailestd_monitor_poll_add(_this, cold, now);
+		if (!mailestd_monitor_watch(_this, fld))
+			return (false);
+	}
+	MAILESTD_DBG((LOG_DEBUG, "HOT %s", fld->path));
+	fld->active = *now;
+
+	return (true);
+}
+
+/*
+ * Poll the folders not watched by the mtime and ctime of the directories.
+ * The interval is doubled while a folder is not changed, and reset when
+ * it's changed, so the recently active ones are polled more often.  The
+ * polls are limited to "poll-rate" per second, the rest wait for the next
+ * second in the order of their time.  Returns the number of the folders
+ * polled and "wait" is set until the next poll.
+ */
+static int
+mailestd_monitor_poll(struct mailestd *_this, struct timespec *wait)
+{
+	struct timespec	 now, mtime, ctime;
+	struct folder	*fld;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (_this->monitor_poll_sec != now.tv_sec) {
+		_this->monitor_poll_sec = now.tv_sec;
+		_this->monitor_poll_count = 0;
+	}
+	while ((fld = RB_MIN(folder_poll_tree, &_this->monitor_polls))
+	    != NULL && !timespeccmp(&now, &fld->pollat, <)) {
+		if (_this->monitor_poll_count >= _this->monitor_poll_rate) {
+			wait->tv_sec = 0;
+			wait->tv_nsec = 1000000000L - now.tv_nsec;
+			return (1);
+		}
+		_this->monitor_poll_count++;
+		RB_REMOVE(folder_poll_tree, &_this->monitor_polls, fld);
+		if (!mailestd_monitor_stat(fld->path, &mtime, &ctime)) {
+			/* removed, gather to remove the messages */
+			fld->polled = false;
+			fld->pollonly = false;
+			mailestd_monitor_pend(_this, fld, &now);
+			continue;
+		}
+		if (timespeccmp(&fld->dirmtime, &mtime, ==) &&
+		    timespeccmp(&fld->dirctime, &ctime, ==)) {
+			timespecadd(&fld->pollint, &fld->pollint,
+			    &fld->pollint);
+			if (fld->pollint.tv_sec > MAILESTD_MONITOR_POLLMAX)
+				fld->pollint.tv_sec = MAILESTD_MONITOR_POLLMAX;
+		} else {
+			fld->dirmtime = mtime;
+			fld->dirctime = ctime;
+			fld->pollint.tv_sec = MAILESTD_MONITOR_POLLMIN;
+			mailestd_monitor_pend(_this, fld, &now);
+			if (mailestd_monitor_promote(_this, fld, &now)) {
+				fld->polled = false;
+				continue;
+			}
+		}
+		timespecadd(&now, &fld->pollint, &fld->pollat);
+		RB_INSERT(folder_poll_tree, &_this->monitor_polls, fld);
+	}
+	if (fld == NULL)
+		return (0);
+	timespecsub(&fld->pollat, &now, wait);
+
+	return (1);
+}
+
+/*
+ * Get the mtime and ctime of the directory.  The attributes cached are
+ * used on the network filesystems since another client doesn't notify
+ * the changes anyway.
+ */
+static bool
+mailestd_monitor_stat(const char *path, struct timespec *mtime,
+    struct timespec *ctime)
+{
+#ifdef STATX_BASIC_STATS
+	struct statx	 stx;
+
+	if (statx(AT_FDCWD, path, AT_STATX_DONT_SYNC | AT_NO_AUTOMOUNT,
+	    STATX_TYPE | STATX_MTIME | STATX_CTIME, &stx) == -1 ||
+	    !S_ISDIR(stx.stx_mode))
+		return (false);
+	mtime->tv_sec = stx.stx_mtime.tv_sec;
+	mtime->tv_nsec = stx.stx_mtime.tv_nsec;
+	ctime->tv_sec = stx.stx_ctime.tv_sec;
+	ctime->tv_nsec = stx.stx_ctime.tv_nsec;
+#else
+	struct stat	 st;
+
+	if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+		return (false);
+	*mtime = st.st_mtim;
+	*ctime = st.st_ctim;
+#endif
+	return (true);
 }
 
 static void
@@ -2864,6 +6113,7 @@ mailestd_monitor_maildir_changed(struct mailestd *_this)
 	struct dirent	*de;
 	char		 path[PATH_MAX];
 	struct folder	*fld, fld0;
+	struct timespec	 now;
 
 	strlcpy(path, _this->maildir, sizeof(path));
 	path[_this->lmaildir] = '/';
@@ -2887,105 +6137,233 @@ mailestd_monitor_maildir_changed(struct mailestd *_this)
 		mailestd_monitor_folder(_this, path);
 		fld = RB_FIND(folder_tree, &_this->monitors, &fld0);
 		MAILESTD_ASSERT(fld != NULL);
-		clock_gettime(CLOCK_MONOTONIC, &fld->mtime);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		mailestd_monitor_pend(_this, fld, &now);
 	}
 	closedir(dp);
 }
 
-static int
-mailestd_monitor_schedule(struct mailestd *_this, struct timespec *wait)
+/*
+ * Pend gathering the folder changed at "mtime".  The folder is fired
+ * after the monitor delay passes without another change.  While the
+ * changes continue, the delay is extended to the half of the time they
+ * have lasted, but the folder is fired by its max delay from the first
+ * change.
+ */
+static void
+mailestd_monitor_pend(struct mailestd *_this, struct folder *fld,
+    struct timespec *mtime)
 {
-	int			 pends;
-	struct timespec		 currtime, diffts, maxts;
-	struct folder		*dir0, *dir1, *maildir = NULL;
-	struct dirpend {
-		struct folder		*dir;
-		TAILQ_ENTRY(dirpend)	 queue;
-	}			*pnde, *pndt;
-	TAILQ_HEAD(, dirpend)	 pend;
-	char			 buf[PATH_MAX];
-
-	TAILQ_INIT(&pend);
-	RB_FOREACH(dir0, folder_tree, &_this->monitors) {
-		if (dir0->mtime.tv_sec == 0 && dir0->mtime.tv_nsec == 0)
-			continue;
-		if (strcmp(dir0->path, _this->maildir) == 0) {
-			maildir = dir0;
-			continue;
-		}
-		/*
-		 * pending entry
-		 */
-		TAILQ_FOREACH_SAFE(pnde, &pend, queue, pndt) {
-			dir1 = pnde->dir;
-			if (is_parent_dir(dir0->path, dir1->path)) {
-				if (timespeccmp(&dir0->mtime, &dir1->mtime, <))
-					dir0->mtime = dir1->mtime;
-				timespecclear(&dir1->mtime);
-				TAILQ_REMOVE(&pend, pnde, queue);
-			}
-			if (is_parent_dir(dir1->path, dir0->path)) {
-				if (timespeccmp(&dir1->mtime, &dir0->mtime, <))
-					dir1->mtime = dir0->mtime;
-				timespecclear(&dir0->mtime);
-			}
+	struct timespec	 delay;
+
+	if (fld->heapidx == 0)
+		fld->first = *mtime;
+	timespecsub(mtime, &fld->first, &delay);
+	delay.tv_nsec = ((delay.tv_sec % 2) * 1000000000L + delay.tv_nsec) / 2;
+	delay.tv_sec /= 2;
+	if (timespeccmp(&delay, &_this->monitor_delay, <))
+		delay = _this->monitor_delay;
+	fld->mtime = *mtime;
+	timespecadd(mtime, &delay, &fld->fire);
+	mailestd_monitor_bound(fld);
+	mailestd_monitor_heap_add(_this, fld);
+}
+
+/* fire the folder by its max delay */
+static void
+mailestd_monitor_bound(struct folder *fld)
+{
+	struct timespec	 limit;
+
+	timespecadd(&fld->first, &fld->maxdelay, &limit);
+	if (timespeccmp(&limit, &fld->fire, <))
+		fld->fire = limit;
+}
+
+static void
+mailestd_monitor_heap_add(struct mailestd *_this, struct folder *fld)
+{
+	if (fld->heapidx == 0) {
+		/* the heap starts at 1 */
+		if (_this->monitor_nheap + 1 >= _this->monitor_heapsiz) {
+			_this->monitor_heapsiz = (_this->monitor_heapsiz == 0)
+			    ? 64 : _this->monitor_heapsiz * 2;
+			_this->monitor_heap = xreallocarray(
+			    _this->monitor_heap, _this->monitor_heapsiz,
+			    sizeof(struct folder *));
 		}
-		if (dir0->mtime.tv_sec != 0) {
-			pnde = xcalloc(1, sizeof(struct dirpend));
-			pnde->dir = dir0;
-			TAILQ_INSERT_TAIL(&pend, pnde, queue);
+		fld->heapidx = ++_this->monitor_nheap;
+		_this->monitor_heap[fld->heapidx] = fld;
+		RB_INSERT(folder_pend_tree, &_this->monitor_pends, fld);
+	}
+	mailestd_monitor_heap_fix(_this, fld->heapidx);
+}
+
+static void
+mailestd_monitor_unpend(struct mailestd *_this, struct folder *fld)
+{
+	int		 idx = fld->heapidx;
+	struct folder	*last;
+
+	MAILESTD_ASSERT(idx > 0);
+	RB_REMOVE(folder_pend_tree, &_this->monitor_pends, fld);
+	last = _this->monitor_heap[_this->monitor_nheap--];
+	fld->heapidx = 0;
+	if (last != fld) {
+		_this->monitor_heap[idx] = last;
+		last->heapidx = idx;
+		mailestd_monitor_heap_fix(_this, idx);
+	}
+}
+
+/* move the folder at "idx" of the heap up or down to its place */
+static void
+mailestd_monitor_heap_fix(struct mailestd *_this, int idx)
+{
+	int		  child;
+	struct folder	**heap = _this->monitor_heap, *fld = heap[idx];
+
+	while (idx > 1 && timespeccmp(&fld->fire, &heap[idx / 2]->fire, <)) {
+		heap[idx] = heap[idx / 2];
+		heap[idx]->heapidx = idx;
+		idx /= 2;
+	}
+	while ((child = idx * 2) <= _this->monitor_nheap) {
+		if (child + 1 <= _this->monitor_nheap && timespeccmp(
+		    &heap[child + 1]->fire, &heap[child]->fire, <))
+			child++;
+		if (!timespeccmp(&heap[child]->fire, &fld->fire, <))
+			break;
+		heap[idx] = heap[child];
+		heap[idx]->heapidx = idx;
+		idx = child;
+	}
+	heap[idx] = fld;
+	fld->heapidx = idx;
+}
+
+/* configure the folder by the first "monitor folder" matched */
+static void
+mailestd_monitor_conf(struct mailestd *_this, struct folder *fld)
+{
+	int		 i;
+	long		 msec = _this->monitor_max_delay;
+	const char	*name = "";
+
+	if (is_parent_dir(_this->maildir, fld->path))
+		name = fld->path + _this->lmaildir + 1;
+	for (i = 0; i < _this->nmonitor_folders; i++) {
+		if (fnmatch(_this->monitor_folders[i].folder, name, 0) == 0) {
+			if (_this->monitor_folders[i].max_delay >= 0)
+				msec = _this->monitor_folders[i].max_delay;
+			fld->pollonly = (_this->monitor_folders[i].poll != 0);
+			break;
 		}
 	}
-	if (maildir != NULL) {
-		pnde = xcalloc(1, sizeof(struct dirpend));
-		pnde->dir = maildir;
-		TAILQ_INSERT_TAIL(&pend, pnde, queue);
+	fld->maxdelay.tv_sec = msec / 1000;
+	fld->maxdelay.tv_nsec = (msec % 1000) * 1000000L;
+}
+
+/* stop monitoring the folder if it is removed */
+static void
+mailestd_monitor_release(struct mailestd *_this, struct folder *fld)
+{
+	if (fld->fd <= 0 && !fld->polled) {
+		mailestd_log(LOG_DEBUG, "Stop monitoring %s", fld->path);
+		RB_REMOVE(folder_tree, &_this->monitors, fld);
+		folder_free(fld);
 	}
+}
 
-	if (TAILQ_EMPTY(&pend))
-		return (0);
+/*
+ * Fire the pending folders whose time has come.  A folder is gathered
+ * together with its subfolders, so a subfolder is left to its pending
+ * parent and the pending subfolders are taken by the folder being fired.
+ * Returns the number of the folders still pending and "wait" is set
+ * until the next one.
+ */
+static int
+mailestd_monitor_schedule(struct mailestd *_this, struct timespec *wait)
+{
+	size_t			 lpath;
+	char			*sl, buf[PATH_MAX];
+	struct timespec		 currtime, diffts;
+	struct folder		*dir0, *dir1, *dirt, fld0;
 
-	pends = 0;
-	timespecclear(&maxts);
 	clock_gettime(CLOCK_MONOTONIC, &currtime);
-	TAILQ_FOREACH_SAFE(pnde, &pend, queue, pndt) {
-		dir0 = pnde->dir;
-		free(pnde);
+	while (_this->monitor_nheap > 0) {
+		dir0 = _this->monitor_heap[1];
+		if (timespeccmp(&currtime, &dir0->fire, <))
+			break;
+		mailestd_monitor_unpend(_this, dir0);
 		timespecsub(&currtime, &dir0->mtime, &diffts);
-		if (timespeccmp(&diffts, &_this->monitor_delay, >=)) {
+		if (strcmp(dir0->path, _this->maildir) == 0) {
 			MAILESTD_DBG((LOG_DEBUG, "FIRE %lld.%09lld %s",
 			    (long long)diffts.tv_sec, (long long)
 			    diffts.tv_nsec, dir0->path));
-			timespecclear(&dir0->mtime);
-			if (strcmp(dir0->path, _this->maildir) == 0) {
-				mailestd_monitor_maildir_changed(_this);
-				/* may scheduled again */
-				pends++;
-			} else {
-				mailestd_log(LOG_INFO, "Gathering %s by "
-				    "monitor", mailestd_folder_name(_this,
-				    dir0->path, buf, sizeof(buf)));
-				mailestd_schedule_gather_start(_this,
-				    dir0->path);
+			/* may schedule new folders */
+			mailestd_monitor_maildir_changed(_this);
+			continue;
+		}
+
+		/* a pending parent, which fires later, takes this */
+		strlcpy(buf, dir0->path, sizeof(buf));
+		fld0.path = buf;
+		dir1 = NULL;
+		for (sl = buf + _this->lmaildir + 1;
+		    (sl = strchr(sl, '/')) != NULL; *sl++ = '/') {
+			*sl = '\0';
+			if ((dir1 = RB_FIND(folder_pend_tree,
+			    &_this->monitor_pends, &fld0)) != NULL)
+				break;
+		}
+		if (dir1 != NULL) {
+			if (timespeccmp(&dir0->first, &dir1->first, <)) {
+				dir1->first = dir0->first;
+				mailestd_monitor_bound(dir1);
+				mailestd_monitor_heap_fix(_this,
+				    dir1->heapidx);
 			}
-			if (dir0->fd <= 0) {
-				mailestd_log(LOG_DEBUG,
-				    "Stop monitoring %s", dir0->path);
-				RB_REMOVE(folder_tree, &_this->monitors, dir0);
-				folder_free(dir0);
+			mailestd_monitor_release(_this, dir0);
+			continue;
+		}
+
+		/* take the pending subfolders, they are in a row */
+		lpath = strlcpy(buf, dir0->path, sizeof(buf));
+		strlcat(buf, "/", sizeof(buf));
+		for (dir1 = RB_NFIND(folder_pend_tree, &_this->monitor_pends,
+		    &fld0); dir1 != NULL && strncmp(dir1->path, buf, lpath + 1)
+		    == 0; dir1 = dirt) {
+			dirt = RB_NEXT(folder_pend_tree, &_this->monitor_pends,
+			    dir1);
+			if (timespeccmp(&dir0->fire, &dir1->fire, <)) {
+				dir0->mtime = dir1->mtime;
+				dir0->fire = dir1->fire;
 			}
-		} else if (timespeccmp(&diffts, &maxts, >)) {
-			MAILESTD_DBG((LOG_DEBUG, "PEND %lld.%09lld %s",
-			    (long long)diffts.tv_sec,
-			    (long long)diffts.tv_nsec, dir0->path));
-			maxts = diffts;
-			pends++;
+			if (timespeccmp(&dir1->first, &dir0->first, <))
+				dir0->first = dir1->first;
+			mailestd_monitor_unpend(_this, dir1);
+			mailestd_monitor_release(_this, dir1);
+		}
+		mailestd_monitor_bound(dir0);
+		if (timespeccmp(&currtime, &dir0->fire, <)) {
+			/* a subfolder is changed later */
+			mailestd_monitor_heap_add(_this, dir0);
+			continue;
 		}
+
+		MAILESTD_DBG((LOG_DEBUG, "FIRE %lld.%09lld %s",
+		    (long long)diffts.tv_sec, (long long)diffts.tv_nsec,
+		    dir0->path));
+		mailestd_log(LOG_INFO, "Gathering %s by monitor",
+		    mailestd_folder_name(_this, dir0->path, buf, sizeof(buf)));
+		mailestd_schedule_gather_start(_this, dir0->path);
+		mailestd_monitor_release(_this, dir0);
 	}
-	if (pends > 0)
-		timespecsub(&_this->monitor_delay, &maxts, wait);
+	if (_this->monitor_nheap > 0)
+		timespecsub(&_this->monitor_heap[1]->fire, &currtime, wait);
 
-	return (pends);
+	return (_this->monitor_nheap);
 }
 
 /***********************************************************************
@@ -3274,6 +6652,34 @@ folder_compar(struct folder *a, struct folder *b)
 	return strcmp(a->path, b->path);
 }
 
+static int
+folder_wd_compar(struct folder *a, struct folder *b)
+{
+	return ((a->fd < b->fd)? -1 : (a->fd > b->fd)? 1 : 0);
+}
+
+static int
+folder_poll_compar(struct folder *a, struct folder *b)
+{
+	if (!timespeccmp(&a->pollat, &b->pollat, ==))
+		return (timespeccmp(&a->pollat, &b->pollat, <)? -1 : 1);
+	return strcmp(a->path, b->path);
+}
+
+static int
+monitor_op_compar(struct monitor_op *a, struct monitor_op *b)
+{
+	return strcmp(a->path, b->path);
+}
+
+static void
+monitor_op_free(struct monitor_op *op)
+{
+	free(op->from);
+	free(op->path);
+	free(op);
+}
+
 static void
 folder_free(struct folder *dir)
 {
@@ -3281,6 +6687,30 @@ folder_free(struct folder *dir)
 	free(dir);
 }
 
+static int
+dircache_compar(struct dircache *a, struct dircache *b)
+{
+	return strcmp(a->path, b->path);
+}
+
+static int
+draft_cache_compar(struct draft_cache *a, struct draft_cache *b)
+{
+	if (a->hash != b->hash)
+		return ((a->hash < b->hash)? -1 : 1);
+	if (a->size != b->size)
+		return ((a->size < b->size)? -1 : 1);
+
+	return ((int)a->hdronly - (int)b->hdronly);
+}
+
+static void
+dircache_free(struct dircache *dc)
+{
+	free(dc->path);
+	free(dc);
+}
+
 static bool
 estdoc_add_parid(ESTDOC *doc)
 {
@@ -3336,6 +6766,56 @@ static int msgid_chars[] = {
          1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0  /* pqrstuvwxyz{|}~  */
 };
 
+static size_t
+rfc822_header_length(const char *msgs, size_t msgsiz)
+{
+	const char	*sp, *ep = msgs + msgsiz;
+
+	/* find the empty line which separates the header and the body */
+	for (sp = msgs; (sp = memchr(sp, '\n', ep - sp)) != NULL; ) {
+		sp++;
+		if (sp < ep && *sp == '\r')
+			sp++;
+		if (sp < ep && *sp == '\n')
+			return (sp + 1 - msgs);
+	}
+
+	return (msgsiz);
+}
+
+/*
+ * A quick hash of the message content.  It's not for security, just to
+ * know whether the content is changed when the mtime is changed.
+ */
+static uint64_t
+rfc822_hash(const char *msgs, size_t msgsiz)
+{
+	size_t		 i;
+	uint64_t	 h, w;
+
+	h = UINT64_C(0xcbf29ce484222325) ^ msgsiz;
+	for (i = 0; i + sizeof(w) <= msgsiz; i += sizeof(w)) {
+		memcpy(&w, msgs + i, sizeof(w));
+		h = (h ^ w) * UINT64_C(0x100000001b3);
+		h ^= h >> 29;
+	}
+	for (; i < msgsiz; i++)
+		h = (h ^ (u_char)msgs[i]) * UINT64_C(0x100000001b3);
+	h ^= h >> 32;
+
+	return ((h == 0)? 1 : h);	/* 0 is used for "unknown" */
+}
+
+static uint64_t
+rfc822_hash_attr(ESTDOC *doc)
+{
+	const char	*val;
+
+	if ((val = est_doc_attr(doc, ATTR_HASH)) == NULL)
+		return (0);
+	return (strtoull(val, NULL, 16));
+}
+
 static bool
 valid_msgid(const char *str)
 {
@@ -3383,15 +6863,38 @@ skip_subject(const char *subj)
 }
 
 static const char *
-uri2normalpath(struct mailestd *_this, const char *uri)
+doc2normalpath(struct mailestd *_this, ESTDOC *doc)
 {
-	if (uri == NULL)
+	const char	*path;
+
+	if ((path = doc2path(doc)) == NULL)
 		return (NULL);
-	if (is_parent_dir(_this->maildir, URI2PATH(uri)))
-		return (uri + _this->lmaildir + 8);
+	if (is_parent_dir(_this->maildir, path))
+		return (path + _this->lmaildir + 1);
 	else
-		return (URI2PATH(uri));
+		return (path);
+}
+
+/* the path of the message.  ATTR_PATH is used if the URI is a key */
+static const char *
+doc2path(ESTDOC *doc)
+{
+	const char	*path, *uri;
+
+	if ((path = est_doc_attr(doc, ATTR_PATH)) != NULL)
+		return (path);
+	uri = est_doc_attr(doc, ESTDATTRURI);
+	if (uri == NULL || strncmp(uri, URIFILE "/", 8) != 0)
+		return (NULL);
+
+	return (URI2PATH(uri));
 }
 
 RB_GENERATE_STATIC(rfc822_tree, rfc822, tree, rfc822_compar);
 RB_GENERATE_STATIC(folder_tree, folder, tree, folder_compar);
+RB_GENERATE_STATIC(folder_wd_tree, folder, wdtree, folder_wd_compar);
+RB_GENERATE_STATIC(folder_pend_tree, folder, pendtree, folder_compar);
+RB_GENERATE_STATIC(folder_poll_tree, folder, polltree, folder_poll_compar);
+RB_GENERATE_STATIC(monitor_op_tree, monitor_op, tree, monitor_op_compar);
+RB_GENERATE_STATIC(dircache_tree, dircache, tree, dircache_compar);
+RB_GENERATE_STATIC(draft_cache_tree, draft_cache, tree, draft_cache_compar);
@@ -22,6 +22,7 @@
 #define MAILESTD_SOCK_PATH	".mailest.sock"
 #define MAILESTD_SOCK_MSGSIZ	256	/* response message size */
 #define MAILESTD_MAX_MESSAGE_ID	256
+#define MAILESTD_UPDATE_FILES_SIZ	8000	/* paths in a message */
 
 enum MAILESTCTL_CMD {
 	MAILESTCTL_CMD_NONE = 0,
@@ -33,7 +34,12 @@ enum MAILESTCTL_CMD {
 	MAILESTCTL_CMD_RESUME,
 	MAILESTCTL_CMD_SEARCH,
 	MAILESTCTL_CMD_SMEW,
-	MAILESTCTL_CMD_GUESS_AGAIN
+	MAILESTCTL_CMD_GUESS_AGAIN,
+	MAILESTCTL_CMD_FAILED,
+	MAILESTCTL_CMD_FAILED_CLEAR,
+	MAILESTCTL_CMD_UPDATE_FILES,
+	MAILESTCTL_CMD_REBUILD,
+	MAILESTCTL_CMD_STATS
 };
 
 enum MAILESTCTL_OUTFORM {
@@ -45,6 +51,9 @@ enum MAILESTCTL_OUTFORM {
 #define	ATTR_PARID	"x-mew-parid"
 #define	ATTR_TITLE	"@title"
 #define	ATTR_CDATE	"@cdate"
+#define	ATTR_HDRONLY	"x-mailestd-hdronly"
+#define	ATTR_HASH	"x-mailestd-hash"
+#define	ATTR_PATH	"x-mailestd-path"
 
 struct mailestctl {
 	enum MAILESTCTL_CMD	 command;
@@ -54,6 +63,16 @@ struct mailestctl_update {
 	enum MAILESTCTL_CMD	 command;
 	char			 folder[PATH_MAX];
 };
+/*
+ * The paths are separated by NUL.  Only the used part of "paths" is sent.
+ * The list may be split into multiple messages, "more" is set except the
+ * last one.
+ */
+struct mailestctl_update_files {
+	enum MAILESTCTL_CMD	 command;
+	int			 more;
+	char			 paths[MAILESTD_UPDATE_FILES_SIZ];
+};
 struct mailestctl_search {
 	enum MAILESTCTL_CMD	 command;
 	enum MAILESTCTL_OUTFORM	 outform;
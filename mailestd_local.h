@@ -32,7 +32,14 @@ RB_HEAD(rfc822_tree, rfc822);
 TAILQ_HEAD(rfc822_queue, rfc822);
 TAILQ_HEAD(mailestc_queue, mailestc);
 TAILQ_HEAD(gather_queue, gather);
+TAILQ_HEAD(folder_queue, folder);
 RB_HEAD(folder_tree, folder);
+RB_HEAD(folder_wd_tree, folder);
+RB_HEAD(folder_pend_tree, folder);
+RB_HEAD(folder_poll_tree, folder);
+RB_HEAD(monitor_op_tree, monitor_op);
+RB_HEAD(dircache_tree, dircache);
+RB_HEAD(draft_cache_tree, draft_cache);
 
 struct task_worker {
 	struct mailestd		*mailestd_this;
@@ -45,20 +52,85 @@ struct task_worker {
 	bool			 suspend;
 };
 
+/* a thread for searches, which has its own database handle */
+struct search_worker {
+	struct task_worker	 worker;
+	ESTDB			*db;
+	u_int			 db_gen;
+};
+
+/* a rebuild of the database, the messages are indexed by the shards */
+struct rebuild_item {
+	char			*path;
+	time_t			 mtime;
+	int			 db_id;		/* in the current database */
+	int			 shard;
+};
+
+struct rebuild_shard {
+	struct rebuild		*rebuild;
+	int			 idx;
+	int			 puts;
+	int			 fails;
+	bool			 error;
+};
+
+struct rebuild {
+	struct mailestd		*mailestd_this;
+	_thread_t		 thread;
+	bool			 started;
+	bool			 cancel;
+	bool			 error;
+	time_t			 start;
+	struct rebuild_item	*items;
+	int			 nitems;
+	struct rebuild_shard	 shards[MAILESTD_REBUILD_MAXTHREADS];
+	int			 nshards;
+};
+
+struct mailestd_dbstats {
+	u_int	 flushes;	/* steps of flushing */
+	double	 flushed;	/* bytes of the cache */
+	u_int	 optimizes;
+	u_int	 purges;
+	u_int	 deferred;	/* by the io budget */
+	long	 msec;		/* spent for the maintenance */
+	double	 unoptimized;	/* bytes flushed since the last optimize */
+	int	 garbage;	/* docs deleted without cleaning */
+};
+
 struct mailestd {
 	char			  maildir[PATH_MAX];
 	int			  lmaildir;
 	char			  dbpath[PATH_MAX];
+	char			  failedfn[PATH_MAX];
+	bool			  failed_dirty;
 	char			  logfn[PATH_MAX];
 	int			  logsiz;
 	int			  logmax;
 	char			**suffix;
+	char			**mbox_suffix;
 	char			**folder;
 	int			  doc_trimsize;
 	int			  rfc822_task_max;
 	ESTDB			 *db;
 	bool			  db_wr;
 	char			 *sync_prev;
+	_thread_rwlock_t	  db_lock;	/* while writing the db */
+	bool			  db_locked;
+	struct timespec		  db_locktime;
+	u_int			  db_gen;	/* incremented when published */
+	_thread_spinlock_t	  db_wait_lock;
+	int			  db_waiters;	/* searches waiting for lock */
+	struct event		  db_idletimer;
+	int			  db_io_budget;	/* millisec per second */
+	struct event		  db_mainttimer;
+	struct timespec		  db_maintnext;	/* budget is spent until */
+	struct mailestd_dbstats	  db_stats;
+	bool			  db_bulk;	/* by db_wait_lock */
+	bool			  db_compact;	/* purged, to be compacted */
+	time_t			  db_bulk_time;
+	struct rebuild		 *rebuild;	/* writes are held while it */
 
 	time_t			  curr_time;
 	time_t			  db_sync_time;
@@ -69,22 +141,47 @@ struct mailestd {
 	_thread_spinlock_t	  id_seq_lock;
 	uint64_t		  id_seq;
 	struct rfc822_tree	  root;
+	struct dircache_tree	  dircache;
 	struct rfc822_queue	  rfc822_pendings;
+	struct rfc822_queue	  rfc822_bodies;	/* for headers-first */
 	struct task_queue	  rfc822_tasks;
 	int			  rfc822_ntask;
 	struct task_worker	  dbworker;
 	struct task_worker	  mainworker;
 	struct task_worker	  monitorworker;
-	struct task_worker	 *workers[4];	/* array of all workers */
+	struct task_worker	  scanworker;
+	struct search_worker	  searchworkers[MAILESTD_SEARCH_NTHREADS];
+	int			  nsearchworkers;
+	u_int			  searchnext;
+	struct task_worker	 *workers[5 + MAILESTD_SEARCH_NTHREADS];
 	struct gather_queue	  gathers;
 	struct task_queue	  gather_pendings;
 
 	bool			  monitor;
 	struct timespec		  monitor_delay;
-#ifdef DIRMON_INOTIFY
+	long			  monitor_max_delay;	/* millisec */
+	struct mailestd_conf_monitor
+				 *monitor_folders;
+	int			  nmonitor_folders;
+	struct folder		**monitor_heap;	/* pending by the fire time */
+	int			  monitor_nheap;
+	int			  monitor_heapsiz;
+	struct folder_pend_tree	  monitor_pends;	/* pending by the path */
+	struct folder_queue	  monitor_watched;	/* by the last activity */
+	int			  monitor_nwatches;
+	int			  monitor_watches;	/* max, 0 for no limit */
+	bool			  monitor_exhausted;
+	int			  monitor_poll_rate;	/* per second */
+	time_t			  monitor_poll_sec;
+	int			  monitor_poll_count;	/* in the second */
+	struct folder_poll_tree	  monitor_polls;	/* by the time to poll */
+#ifdef MONITOR_INOTIFY
 	int			  monitor_in;
 	struct event		  monitor_inev;
 	struct event		  monitor_intimerev;
+	struct folder_wd_tree	  monitors_wd;	/* by the watch descriptor */
+	struct monitor_op_tree	  monitor_ops;
+	struct monitor_op	 *monitor_movefrom;
 #endif
 #ifdef MONITOR_KQUEUE
 	int			  monitor_kq;
@@ -95,6 +192,14 @@ struct mailestd {
 
 	bool			  paridguess;
 	int			  paridnotdone;
+	bool			  headersfirst;
+	bool			  contenthash;
+	bool			  inodeorder;
+	bool			  maildirformat;
+	ino_t			  inodeorder_last;
+	struct draft_cache_tree	  draft_cache;
+	uint64_t		  draft_cache_gather;
+	size_t			  draft_cache_siz;
 
 	int			  sock_ctl;
 	struct event		  evsock_ctl;
@@ -113,6 +218,13 @@ struct rfc822 {
 	bool			 ontask;
 	uint64_t		 gather_id;	/* gather of the task */
 	bool			 pariddone;
+	bool			 bodypending;	/* indexed only headers */
+	bool			 draftfailed;	/* for the mtime and size */
+	uint64_t		 hash;		/* of the content */
+	bool			 touchonly;	/* only the mtime is changed */
+	ino_t			 ino;		/* to order the drafts */
+	bool			 renamed;	/* only the path is changed */
+	bool			 modified;	/* renamed but changed too */
 };
 
 enum MAILESTD_TASK {
@@ -125,13 +237,23 @@ enum MAILESTD_TASK {
 	MAILESTD_TASK_SMEW,
 	MAILESTD_TASK_GATHER_START,
 	MAILESTD_TASK_GATHER,
+	MAILESTD_TASK_GATHER_APPLY,
+	MAILESTD_TASK_UPDATE_FILES,
+	MAILESTD_TASK_MBOX_SCAN,
+	MAILESTD_TASK_MBOX_APPLY,
+	MAILESTD_TASK_DIRCACHE_INVALIDATE,
 	MAILESTD_TASK_SYNCDB,
 	MAILESTD_TASK_RFC822_DRAFT,
 	MAILESTD_TASK_RFC822_PUTDB,
 	MAILESTD_TASK_RFC822_DELDB,
 	MAILESTD_TASK_RFC822_GUESS,
 	MAILESTD_TASK_MONITOR_FOLDER,
-	MAILESTD_TASK_GUESS_AGAIN
+	MAILESTD_TASK_GUESS_AGAIN,
+	MAILESTD_TASK_FAILED,
+	MAILESTD_TASK_FAILED_CLEAR,
+	MAILESTD_TASK_REBUILD,
+	MAILESTD_TASK_REBUILD_DONE,
+	MAILESTD_TASK_STATS
 };
 
 struct task {
@@ -149,6 +271,39 @@ struct task_rfc822 {
 	struct rfc822		*msg;
 };
 
+/* an entry of the directory being walked */
+struct walk_ent {
+	const char		*name;
+	size_t			 nameoff;
+	u_int			 seq;		/* number of the name */
+	bool			 ismsg;
+	bool			 ismbox;
+	bool			 isdir;
+	bool			 needstat;
+	bool			 statok;
+	time_t			 mtime;
+	off_t			 size;
+	ino_t			 ino;
+};
+
+/* a directory listed by the scanner */
+struct scan_dir {
+	char			*path;
+	bool			 skipped;	/* not changed since the last */
+	bool			 missing;	/* the folder is not found */
+	int			 nmsgs;		/* on the dircache if skipped */
+	struct walk_ent		*ents;		/* messages in sorted order */
+	struct walk_ent		**byname;	/* ents in the tree order */
+	int			 nents;
+	char			*names;
+	char			**subdirs;	/* names, sorted */
+	int			 nsubdirs;
+	struct walk_ent		*mboxes;	/* sorted by the name */
+	int			 nmboxes;
+	TAILQ_ENTRY(scan_dir)	 queue;
+};
+TAILQ_HEAD(scan_dir_queue, scan_dir);
+
 struct task_gather {
 	uint64_t		 id;
 	enum MAILESTD_TASK	 type;
@@ -156,6 +311,53 @@ struct task_gather {
 	bool			 highprio;
 	uint64_t		 gather_id;
 	char			 folder[PATH_MAX];
+	/* result of the scan, consumed by the dbworker */
+	struct scan_dir_queue	 dirs;
+	bool			 scanerr;
+	int			 total;
+	int			 update;
+	int			 delete;
+	time_t			 fstime;
+};
+
+struct task_update_files {
+	uint64_t		 id;
+	enum MAILESTD_TASK	 type;
+	TAILQ_ENTRY(task)	 queue;
+	bool			 highprio;
+	uint64_t		 gather_id;
+	bool			 more;		/* not the last of the list */
+	size_t			 pathsiz;
+	char			 paths[MAILESTD_UPDATE_FILES_SIZ];
+};
+
+/* read the messages appended to a mbox */
+struct task_mbox {
+	uint64_t		 id;
+	enum MAILESTD_TASK	 type;
+	TAILQ_ENTRY(task)	 queue;
+	bool			 highprio;
+	uint64_t		 gather_id;
+	char			 path[PATH_MAX];
+	time_t			 mtime;
+	ino_t			 ino;
+	time_t			 fstime;
+	off_t			 start;		/* offset to start reading */
+	off_t			 lastmsg;	/* of the last message known */
+	/* result of the scan, consumed by the dbworker */
+	bool			 full;		/* read from the beginning */
+	bool			 scanerr;
+	off_t			*offs;		/* start of the messages */
+	int			 noffs;
+	off_t			 end;		/* end of the last message */
+};
+
+struct task_dircache {
+	uint64_t		 id;
+	enum MAILESTD_TASK	 type;
+	TAILQ_ENTRY(task)	 queue;
+	bool			 highprio;
+	char			 path[PATH_MAX];
 };
 
 struct task_monitor {
@@ -205,13 +407,13 @@ struct mailestc {
 	enum MAILESTCTL_CMD	 monitoring_cmd;
 	uint64_t		 monitoring_id;
 	bool			 monitoring_stop;
+	bool			 monitoring_more;	/* list continues */
 };
 
 struct task_dbworker_context {
 	int	 puts;
 	int	 resche;
 	int	 dels;
-	bool	 optimized;
 };
 
 struct gather {
@@ -224,14 +426,69 @@ struct gather {
 	u_int			 folders_done;
 	char			 errmsg[80];
 	char			 target[PATH_MAX];
+	uint64_t		*joined;	/* ids of the joined requests */
+	int			 njoined;
 	TAILQ_ENTRY(gather)	 queue;
 };
 
 struct folder {
 	int			 fd;
 	char			*path;
-	struct timespec		 mtime;
+	struct timespec		 mtime;		/* last changed */
+	struct timespec		 first;		/* first changed */
+	struct timespec		 fire;		/* when to gather */
+	struct timespec		 maxdelay;	/* from the first change */
+	int			 heapidx;	/* 0 if not pending */
+	struct timespec		 active;	/* last event of the watch */
+	bool			 polled;	/* not watched, but polled */
+	bool			 pollonly;	/* never watched */
+	struct timespec		 dirmtime;
+	struct timespec		 dirctime;
+	struct timespec		 pollat;
+	struct timespec		 pollint;
 	RB_ENTRY(folder)	 tree;
+	RB_ENTRY(folder)	 wdtree;
+	RB_ENTRY(folder)	 pendtree;
+	RB_ENTRY(folder)	 polltree;
+	TAILQ_ENTRY(folder)	 watchq;
+};
+
+/* a change of a file noticed by the monitor, to update it directly */
+struct monitor_op {
+	char			*path;
+	char			*from;		/* renamed from */
+	uint32_t		 cookie;	/* of IN_MOVED_FROM */
+	bool			 created;	/* may be being written */
+	struct timespec		 time;
+	RB_ENTRY(monitor_op)	 tree;
+};
+
+/* ancestors of the directory being walked to avoid the loop */
+struct walk_anc {
+	dev_t			 dev;
+	ino_t			 ino;
+	struct walk_anc		*parent;
+};
+
+/* drafts of the messages parsed in the gather, reused for their copies */
+struct draft_cache {
+	uint64_t		 hash;
+	off_t			 size;
+	bool			 hdronly;
+	char			*draft;
+	RB_ENTRY(draft_cache)	 tree;
+};
+
+/* to skip the directories which are not changed since the last gather */
+struct dircache {
+	char			*path;
+	struct timespec		 mtime;
+	struct timespec		 ctime;
+	int			 nmsgs;
+	int			 nsubdirs;
+	int			 nmboxes;	/* never skipped if any */
+	time_t			 fstime;
+	RB_ENTRY(dircache)	 tree;
 };
 
 #define mailestd_is_db_sync_done(_mailestd)	\
@@ -255,6 +512,12 @@ struct folder {
 
 RB_PROTOTYPE_STATIC(rfc822_tree, rfc822, tree, rfc822_compar);
 RB_PROTOTYPE_STATIC(folder_tree, folder, tree, folder_compar);
+RB_PROTOTYPE_STATIC(folder_wd_tree, folder, wdtree, folder_wd_compar);
+RB_PROTOTYPE_STATIC(folder_pend_tree, folder, pendtree, folder_compar);
+RB_PROTOTYPE_STATIC(folder_poll_tree, folder, polltree, folder_poll_compar);
+RB_PROTOTYPE_STATIC(monitor_op_tree, monitor_op, tree, monitor_op_compar);
+RB_PROTOTYPE_STATIC(dircache_tree, dircache, tree, dircache_compar);
+RB_PROTOTYPE_STATIC(draft_cache_tree, draft_cache, tree, draft_cache_compar);
 
 static void	 mailestd_init(struct mailestd *, struct mailestd_conf *,
 		    const char **);
@@ -277,21 +540,110 @@ static const char *
 static ESTDB	*mailestd_db_open_rd(struct mailestd *);
 static ESTDB	*mailestd_db_open_wr(struct mailestd *);
 static void	 mailestd_db_close(struct mailestd *);
+static void	 mailestd_db_lock(struct mailestd *);
+static void	 mailestd_db_publish(struct mailestd *);
+static void	 mailestd_db_on_idle(int, short, void *);
+static int	 mailestd_db_maintain(struct mailestd *);
+static void	 mailestd_db_on_maint(int, short, void *);
+static void	 mailestd_db_rest(struct mailestd *);
+static void	 mailestd_db_stats_log(struct mailestd *);
+static void	 mailestd_db_stats(struct mailestd *, struct task *);
+static void	 mailestd_db_load_garbage(struct mailestd *);
+static int	 mailestd_db_waiters(struct mailestd *);
+static bool	 mailestd_db_interrupted(struct mailestd *);
+static void	 mailestd_db_bulk_done(struct mailestd *);
+static void	 mailestd_db_recover(struct mailestd *);
 static void	 mailestd_db_add_msgid_index(struct mailestd *);
 static int	 mailestd_db_sync(struct mailestd *);
-static int	 mailestd_gather(struct mailestd *, struct task_gather *);
+static bool	 mailestd_gather(struct mailestd *, struct task_gather *);
+static void	 mailestd_scan(struct mailestd *, struct task_gather *);
+static void	 scan_dir_free(struct scan_dir *);
+static bool	 mailestd_update_files_path(struct mailestd *, const char *,
+		    char *, size_t);
+static void	 mailestd_update_files(struct mailestd *,
+		    struct task_update_files *);
 static void	 mailestd_gather_inform(struct mailestd *, struct task *,
 		    struct gather *);
-static int	 mailestd_fts(struct mailestd *, struct gather *, time_t,
-		    FTS *, FTSENT *, struct folder_tree *);
-static int	 mailestd_fts_compar(const FTSENT **, const FTSENT **);
+static void	 mailestd_gather_notify(struct mailestd *, struct gather *);
+static int	 mailestd_gather_queued(struct mailestd *, struct gather *);
+static void	 gather_free(struct gather *);
+static int	 mailestd_walk(struct mailestd *, struct task_gather *, time_t,
+		    const char *, struct walk_anc *);
+static bool	 mailestd_is_msgname(struct mailestd *, const char *, u_int *);
+static bool	 mailestd_is_maildir_dir(struct mailestd *, const char *,
+		    size_t);
+static bool	 mailestd_is_maildir_msgname(const char *, u_int *);
+static const char *
+		 mailestd_msg_key(struct mailestd *, const char *, char *,
+		    size_t);
+static struct rfc822 *
+		 mailestd_maildir_renamed(struct mailestd *, const char *);
+static void	 mailestd_msg_move(struct mailestd *, struct rfc822 *,
+		    const char *);
+static void	 mailestd_walk_stat0(int, struct walk_ent *, int);
+static void	 mailestd_walk_stat(int, struct walk_ent *, int);
+static void	 mailestd_gather_merge(struct mailestd *, struct gather *,
+		    struct task_gather *, struct scan_dir *, time_t);
+static void	 mailestd_gather_delete(struct mailestd *, struct gather *,
+		    struct task_gather *, struct rfc822 *, time_t);
+static void	 mailestd_remove(struct mailestd *, struct gather *,
+		    struct rfc822 *);
+static bool	 mailestd_is_mboxname(struct mailestd *, const char *,
+		    size_t);
+static bool	 mailestd_is_mbox_msg(struct mailestd *, const char *,
+		    size_t *, off_t *, off_t *);
+static off_t	 mailestd_mbox_end(struct mailestd *, const char *, off_t *);
+static bool	 mailestd_mbox_boundary(int, off_t, off_t);
+static void	 mailestd_mbox_scan(struct mailestd *, struct task_mbox *);
+static void	 mailestd_mbox_apply(struct mailestd *, struct task_mbox *);
+static bool	 mailestd_gather_file(struct mailestd *, struct gather *,
+		    time_t, struct rfc822 *, const char *, struct walk_ent *);
+static bool	 mailestd_dircache_skip(struct mailestd *, const char *,
+		    struct stat *, time_t, struct folder_tree *, int *);
+static void	 mailestd_dircache_update(struct mailestd *, const char *,
+		    struct stat *, int, int, int, time_t);
+static void	 mailestd_dircache_prune(struct mailestd *, const char *,
+		    time_t);
+static void	 mailestd_dircache_invalidate(struct mailestd *,
+		    const char *);
+static uint64_t	 mailestd_schedule_dircache_invalidate(struct mailestd *,
+		    const char *, size_t);
 static void	 mailestd_draft(struct mailestd *, struct rfc822 *msg);
 static void	 mailestd_putdb(struct mailestd *, struct rfc822 *);
+static bool	 mailestd_putdb_mdate(struct mailestd *, struct rfc822 *);
+static const char *
+		 mailestd_draft_cache_get(struct mailestd *, uint64_t,
+		    uint64_t, off_t, bool);
+static void	 mailestd_draft_cache_put(struct mailestd *, uint64_t, off_t,
+		    bool, ESTDOC *);
+static void	 mailestd_draft_cache_clear(struct mailestd *);
 static void	 mailestd_deldb(struct mailestd *, struct rfc822 *);
-static void	 mailestd_search(struct mailestd *, uint64_t, const char *,
-		    ESTCOND *, enum MAILESTCTL_OUTFORM);
+static void	 mailestd_search(struct mailestd *, ESTDB *, uint64_t,
+		    const char *, ESTCOND *, enum MAILESTCTL_OUTFORM);
+static struct task_worker
+		*mailestd_searcher(struct mailestd *);
+static struct search_worker
+		*mailestd_search_worker(struct mailestd *,
+		    struct task_worker *);
+static void	 mailestd_search_on_proc(struct mailestd *,
+		    struct search_worker *, struct task *);
 static void	 mailestd_db_guess_again(struct mailestd *, struct task *);
+static void	 mailestd_db_rebuild(struct mailestd *, struct task *);
+static void	 mailestd_db_rebuild_done(struct mailestd *);
+static void	 mailestd_db_rebuild_cancel(struct mailestd *);
+static void	*mailestd_rebuild_start(void *);
+static void	*mailestd_rebuild_shard_start(void *);
+static void	 mailestd_rebuild_shard(struct rebuild_shard *);
+static bool	 mailestd_rebuild_merge(struct rebuild *);
+static bool	 mailestd_rebuild_holds(struct task *);
+static void	 mailestd_rebuild_free(struct rebuild *);
+static ESTDB	*mailestd_rebuild_db_open(struct mailestd *, const char *);
 static void	 mailestd_guess_parid(struct mailestd *);
+static void	 mailestd_failed_load(struct mailestd *);
+static void	 mailestd_failed_save(struct mailestd *);
+static void	 mailestd_failed_list(struct mailestd *, struct task *);
+static void	 mailestd_failed_clear(struct mailestd *, struct task *);
+static void	 mailestd_failed_forget(struct mailestd *, struct rfc822 *);
 static void	 mailestd_db_informer(const char *, void *);
 static void	 mailestd_db_error(struct mailestd *);
 
@@ -301,8 +653,17 @@ static uint64_t  mailestd_schedule_gather_start(struct mailestd *,
 		    const char *);
 static void	 mailestd_gather_enqueue(struct task_queue *, struct gather *,
 		    const char *);
+static uint64_t	 mailestd_schedule_update_files(struct mailestd *, uint64_t,
+		    const char *, size_t, bool);
+static uint64_t	 mailestd_schedule_mbox_scan(struct mailestd *,
+		    struct gather *, const char *, struct walk_ent *, off_t,
+		    off_t, bool, time_t);
 static uint64_t	 mailestd_schedule_draft(struct mailestd *, struct gather *,
 		    struct rfc822 *);
+static uint64_t	 mailestd_reschedule_draft(struct mailestd *);
+static struct rfc822 *
+		 mailestd_inodeorder_pick(struct mailestd *,
+		    struct rfc822_queue *);
 static uint64_t  mailestd_schedule_putdb(struct mailestd *, struct task *,
 		    struct rfc822 *);
 static uint64_t	 mailestd_schedule_deldb(struct mailestd *, struct gather *,
@@ -343,10 +704,34 @@ static void	 mailestd_monitor_init(struct mailestd *);
 static void	 mailestd_monitor_start(struct mailestd *);
 static void	 mailestd_monitor_run(struct mailestd *);
 static void	 mailestd_monitor_fini(struct mailestd *);
-#ifdef DIRMON_INOTIFY
+#ifdef MONITOR_INOTIFY
 static void	 mailestd_monitor_on_inotify(int, short, void *);
+static void	 mailestd_monitor_file(struct mailestd *, struct folder *,
+		    struct inotify_event *, struct timespec *);
+static int	 mailestd_monitor_flush(struct mailestd *, struct timespec *,
+		    struct timespec *);
 #endif
 static void	 mailestd_monitor_folder(struct mailestd *, const char *);
+static bool	 mailestd_monitor_watch(struct mailestd *, struct folder *);
+static void	 mailestd_monitor_unwatch(struct mailestd *, struct folder *);
+static void	 mailestd_monitor_touch(struct mailestd *, struct folder *,
+		    struct timespec *);
+static void	 mailestd_monitor_poll_add(struct mailestd *, struct folder *,
+		    struct timespec *);
+static bool	 mailestd_monitor_promote(struct mailestd *, struct folder *,
+		    struct timespec *);
+static int	 mailestd_monitor_poll(struct mailestd *, struct timespec *);
+static void	 mailestd_monitor_pend(struct mailestd *, struct folder *,
+		    struct timespec *);
+static void	 mailestd_monitor_unpend(struct mailestd *, struct folder *);
+static void	 mailestd_monitor_heap_add(struct mailestd *, struct folder *);
+static void	 mailestd_monitor_bound(struct folder *);
+static void	 mailestd_monitor_conf(struct mailestd *, struct folder *);
+static bool	 mailestd_monitor_stat(const char *, struct timespec *,
+		    struct timespec *);
+static void	 mailestd_monitor_heap_fix(struct mailestd *, int);
+static void	 mailestd_monitor_release(struct mailestd *,
+		    struct folder *);
 static int	 mailestd_monitor_schedule(struct mailestd *,
 		    struct timespec *);
 
@@ -367,14 +752,31 @@ static int	 unlimit_data(void);
 static int	 unlimit_nofile(void);
 
 static int	 folder_compar(struct folder *, struct folder *);
+static int	 folder_wd_compar(struct folder *, struct folder *);
+static int	 folder_poll_compar(struct folder *, struct folder *);
+static int	 monitor_op_compar(struct monitor_op *, struct monitor_op *);
+static void	 monitor_op_free(struct monitor_op *);
 static void	 folder_free(struct folder *);
+static int	 dircache_compar(struct dircache *, struct dircache *);
+static int	 draft_cache_compar(struct draft_cache *,
+		    struct draft_cache *);
+static int	 walk_ent_compar(const void *, const void *);
+static int	 walk_ent_name_compar(const void *, const void *);
+static int	 str_compar(const void *, const void *);
+static int	 walk_ent_key_compar(const void *, const void *);
+static void	 dircache_free(struct dircache *);
 static bool	 estdoc_add_parid(ESTDOC *);
+static size_t	 rfc822_header_length(const char *, size_t);
+static uint64_t	 rfc822_hash(const char *, size_t);
+static uint64_t	 rfc822_hash_attr(ESTDOC *);
 static bool	 valid_msgid(const char *);
 static bool	 is_parent_dir(const char *, const char *);
 static const char *
 		 skip_subject(const char *);
 static const char *
-		 uri2normalpath(struct mailestd *, const char *);
+		 doc2path(ESTDOC *);
+static const char *
+		 doc2normalpath(struct mailestd *, ESTDOC *);
 
 #ifndef	nitems
 #define nitems(_n)	(sizeof((_n)) / sizeof((_n)[0]))
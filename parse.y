@@ -105,8 +105,11 @@ typedef struct {
 %}
 
 %token	INCLUDE ERROR
-%token	COUNT DATABASE DEBUG DELAY DISABLE FOLDERS GUESSPARID LEVEL LOG
-%token	MAILDIR MONITOR ROTATE PATH SOCKET SUFFIXES SIZE TASKS TRIMSIZE
+%token	CONTENTHASH COUNT DATABASE DEBUG DELAY DISABLE FOLDER FOLDERS
+%token	GUESSPARID HEADERSFIRST INODEORDER IOBUDGET LEVEL LOG
+%token	MAILDIR MAILDIRFORMAT MAXDELAY MBOXSUFFIXES MONITOR POLL POLLRATE
+%token	ROTATE PATH SOCKET SUFFIXES WATCHES
+%token	SIZE TASKS TRIMSIZE
 %token	<v.string>	STRING
 %token  <v.number>	NUMBER
 %type	<v.strings>	strings
@@ -169,6 +172,18 @@ main		: MAILDIR STRING	{
 		| SUFFIXES strings	{
 			conf->suffixes = $2;
 		}
+		| MBOXSUFFIXES strings	{
+#ifndef HAVE_LIBESTDRAFT
+			int n;
+
+			for (n = 0; $2[n] != NULL; n++)
+				free($2[n]);
+			free($2);
+			yyerror("mbox-suffixes requires libestdraft");
+			YYERROR;
+#endif
+			conf->mbox_suffixes = $2;
+		}
 		| FOLDERS strings	{
 			conf->folders = $2;
 		}
@@ -181,10 +196,48 @@ main		: MAILDIR STRING	{
 			conf->monitor = 1;
 		}
 		| MONITOR monitor_opts
+		| MONITOR FOLDER STRING {
+			struct mailestd_conf_monitor	*mons;
+
+			mons = reallocarray(conf->monitor_folders,
+			    conf->nmonitor_folders + 1,
+			    sizeof(struct mailestd_conf_monitor));
+			if (mons == NULL)
+				fatal("out of memory");
+			conf->monitor_folders = mons;
+			mons[conf->nmonitor_folders].folder = $3;
+			mons[conf->nmonitor_folders].max_delay = -1;
+			mons[conf->nmonitor_folders].poll = 0;
+			conf->nmonitor_folders++;
+		} monitor_folder_opts
 		;
 		| GUESSPARID {
 			conf->paridguess = 1;
 		}
+		| HEADERSFIRST {
+#ifndef HAVE_LIBESTDRAFT
+			logit(LOG_WARNING, "%s:%d: headers-first is ignored "
+			    "without libestdraft", file->name, yylval.lineno);
+#endif
+			conf->headersfirst = 1;
+		}
+		| CONTENTHASH {
+#ifndef HAVE_LIBESTDRAFT
+			logit(LOG_WARNING, "%s:%d: content-hash is ignored "
+			    "without libestdraft", file->name, yylval.lineno);
+#endif
+			conf->contenthash = 1;
+		}
+		| INODEORDER {
+			conf->inodeorder = 1;
+		}
+		| MAILDIRFORMAT {
+#ifndef HAVE_LIBESTDRAFT
+			yyerror("maildir-format requires libestdraft");
+			YYERROR;
+#endif
+			conf->maildirformat = 1;
+		}
 		;
 
 strings		: strings STRING	{
@@ -233,6 +286,13 @@ log_rotate_opt	: COUNT NUMBER		{
 database_opt	: PATH STRING		{
 			conf->db_path = $2;
 		}
+		| IOBUDGET NUMBER	{
+			if ($2 <= 0 || $2 > 1000) {
+				yyerror("io-budget must be 1 to 1000");
+				YYERROR;
+			}
+			conf->db_io_budget = $2;
+		}
 		;
 
 database_opts	: database_opts database_opt
@@ -245,6 +305,46 @@ monitor_opt	: DISABLE		{
 		| DELAY NUMBER		{
 			conf->monitor_delay = $2;
 		}
+		| MAXDELAY NUMBER	{
+			if ($2 < 0) {
+				yyerror("max-delay must not be negative");
+				YYERROR;
+			}
+			conf->monitor_max_delay = $2;
+		}
+		| WATCHES NUMBER	{
+			if ($2 < 0) {
+				yyerror("watches must not be negative");
+				YYERROR;
+			}
+			conf->monitor_watches = $2;
+		}
+		| POLLRATE NUMBER	{
+			if ($2 <= 0) {
+				yyerror("poll-rate must be positive");
+				YYERROR;
+			}
+			conf->monitor_poll_rate = $2;
+		}
+		;
+
+monitor_folder_opt : MAXDELAY NUMBER	{
+			if ($2 < 0) {
+				yyerror("max-delay must not be negative");
+				YYERROR;
+			}
+			conf->monitor_folders[conf->nmonitor_folders - 1]
+			    .max_delay = $2;
+		}
+		| POLL			{
+			conf->monitor_folders[conf->nmonitor_folders - 1]
+			    .poll = 1;
+		}
+		;
+
+monitor_folder_opts : monitor_folder_opts monitor_folder_opt
+		| monitor_folder_opt
+		;
 monitor_opts	: monitor_opts monitor_opt
 		| monitor_opt
 		;
@@ -282,25 +382,36 @@ lookup(char *s)
 {
 	/* this has to be sorted always */
 	static const struct keywords keywords[] = {
+		{ "content-hash",	CONTENTHASH },
 		{ "count",		COUNT },
 		{ "database",		DATABASE },
 		{ "debug",		DEBUG },
 		{ "delay",		DELAY },
 		{ "disable",		DISABLE },
+		{ "folder",		FOLDER },
 		{ "folders",		FOLDERS },
 		{ "guess-parid",	GUESSPARID },
+		{ "headers-first",	HEADERSFIRST },
 		{ "include",		INCLUDE },
+		{ "inode-order",	INODEORDER },
+		{ "io-budget",		IOBUDGET },
 		{ "level",		LEVEL },
 		{ "log",		LOG },
 		{ "maildir",		MAILDIR },
+		{ "maildir-format",	MAILDIRFORMAT },
+		{ "max-delay",		MAXDELAY },
+		{ "mbox-suffixes",	MBOXSUFFIXES },
 		{ "monitor",		MONITOR },
 		{ "path",		PATH },
+		{ "poll",		POLL },
+		{ "poll-rate",		POLLRATE },
 		{ "rotate",		ROTATE },
 		{ "size",		SIZE },
 		{ "socket",		SOCKET },
 		{ "suffixes",		SUFFIXES },
 		{ "tasks",		TASKS },
 		{ "trim-size",		TRIMSIZE },
+		{ "watches",		WATCHES },
 	};
 	const struct keywords	*p;
 
@@ -748,6 +859,14 @@ free_config(struct mailestd_conf *c)
 			free(c->suffixes[i]);
 	}
 	free(c->suffixes);
+	if (c->mbox_suffixes != NULL) {
+		for (i = 0; c->mbox_suffixes[i] != NULL; i++)
+			free(c->mbox_suffixes[i]);
+	}
+	free(c->mbox_suffixes);
+	for (i = 0; i < c->nmonitor_folders; i++)
+		free(c->monitor_folders[i].folder);
+	free(c->monitor_folders);
 	free(c->log_path);
 	free(c->db_path);
 	free(c->sock_path);
@@ -768,8 +887,11 @@ parse_config(const char *filename, const char *maildir)
 	conf->log_size = MAILESTD_LOGSIZ;
 	conf->log_count = MAILESTD_LOGROTMAX;
 	conf->trim_size = MAILESTD_TRIMSIZE;
+	conf->db_io_budget = MAILESTD_DBIOBUDGET;
 	conf->monitor = 1;
 	conf->monitor_delay = MAILESTD_MONITOR_DELAY;
+	conf->monitor_max_delay = MAILESTD_MONITOR_MAXDELAY;
+	conf->monitor_poll_rate = MAILESTD_MONITOR_POLLRATE;
 
 	if (stat(filename, &st) == 0) {
 		if ((file = pushfile(filename, 0)) == NULL) {
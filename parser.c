@@ -59,6 +59,7 @@ static const struct token t_search_attr[];
 static const struct token t_smew[];
 static const struct token t_msgid[];
 static const struct token t_msgid_max[];
+static const struct token t_failed[];
 
 static const struct token t_main[] = {
 	{KEYWORD,	"start",	START,		NULL},
@@ -69,9 +70,13 @@ static const struct token t_main[] = {
 	{KEYWORD,	"message-id",	MESSAGE_ID,	t_msgid},
 	{KEYWORD,	"parent-id",	PARENT_ID,	t_msgid},
 	{KEYWORD,	"update",	UPDATE,		t_folder},
+	{KEYWORD,	"update-files",	UPDATE_FILES,	NULL},
 	{KEYWORD,	"suspend",	SUSPEND,	NULL},
 	{KEYWORD,	"resume",	RESUME,		NULL},
 	{KEYWORD,	"guess",	GUESS,		NULL},
+	{KEYWORD,	"failed",	FAILED,		t_failed},
+	{KEYWORD,	"rebuild",	REBUILD,	NULL},
+	{KEYWORD,	"stats",	STATS,		NULL},
 	{KEYWORD,	"debug",	DEBUGI,		NULL},
 	{KEYWORD,	"-debug",	DEBUGD,		NULL},
 	{ENDTOKEN,	"",		NONE,		NULL}
@@ -119,6 +124,11 @@ static const struct token t_msgid_max[] = {
 	{SEARCH_MAX,	"",		NONE,		t_msgid},
 	{ENDTOKEN,	"",		NONE,		NULL}
 };
+static const struct token t_failed[] = {
+	{NOTOKEN,	"",		NONE,		NULL},
+	{KEYWORD,	"clear",	FAILED_CLEAR,	NULL},
+	{ENDTOKEN,	"",		NONE,		NULL}
+};
 
 static struct parse_result	 res;
 
@@ -183,6 +193,9 @@ match_token(char *word, const struct token table[])
 				t = &table[i];
 				if (t->value)
 					res.action = t->value;
+				/* "update" is a prefix of "update-files" */
+				if (strcmp(word, table[i].keyword) == 0)
+					terminal = 1;
 			}
 			break;
 
@@ -28,7 +28,12 @@ enum actions {
 	MESSAGE_ID,
 	SEARCH_SMEW,
 	PARENT_ID,
-	GUESS
+	GUESS,
+	FAILED,
+	FAILED_CLEAR,
+	UPDATE_FILES,
+	REBUILD,
+	STATS
 };
 
 struct parse_result {
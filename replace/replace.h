@@ -67,6 +67,18 @@ void		*reallocarray(void *, size_t, size_t);
 	} while (0 /*CONSTCOND*/)
 #endif
 
+#ifndef timespecadd
+#define timespecadd(_tsa, _tsb, _tsr)				\
+	do {							\
+		(_tsr)->tv_sec = (_tsa)->tv_sec + (_tsb)->tv_sec;	\
+		(_tsr)->tv_nsec = (_tsa)->tv_nsec + (_tsb)->tv_nsec;	\
+		if ((_tsr)->tv_nsec >= 1000000000L) {		\
+			(_tsr)->tv_sec++;			\
+			(_tsr)->tv_nsec -= 1000000000L;		\
+		}						\
+	} while (0 /*CONSTCOND*/)
+#endif
+
 #ifndef timespecclear
 #define timespecclear(_ts)			\
 	(_ts)->tv_sec = (_ts)->tv_nsec = 0
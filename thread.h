@@ -17,6 +17,7 @@
 #include <pthread.h>
 #define _thread_t		pthread_t
 #define _thread_mutex_t		pthread_mutex_t
+#define _thread_rwlock_t	pthread_rwlock_t
 #define _thread_spinlock_t	pthread_spinlock_t
 #define _thread_self		pthread_self
 #define _thread_join		pthread_join
@@ -25,6 +26,12 @@
 #define _thread_mutex_destroy	pthread_mutex_destroy
 #define _thread_mutex_lock	pthread_mutex_lock
 #define _thread_mutex_unlock	pthread_mutex_unlock
+#define _thread_rwlock_init	pthread_rwlock_init
+#define _thread_rwlock_destroy	pthread_rwlock_destroy
+#define _thread_rwlock_rdlock	pthread_rwlock_rdlock
+#define _thread_rwlock_tryrdlock	pthread_rwlock_tryrdlock
+#define _thread_rwlock_wrlock	pthread_rwlock_wrlock
+#define _thread_rwlock_unlock	pthread_rwlock_unlock
 #define _thread_spin_init	pthread_spin_init
 #define _thread_spin_lock	pthread_spin_lock
 #define _thread_spin_unlock	pthread_spin_unlock
@@ -32,6 +39,7 @@
 #else
 typedef void * _thread_t;
 typedef void * _thread_mutex_t;
+typedef void * _thread_rwlock_t;
 typedef void * _thread_spinlock_t;
 static inline void *_thread_empty()	{ return (void *)0xdeadbeaf; }
 #define _thread_self			_thread_empty
@@ -41,6 +49,12 @@ static inline void *_thread_empty()	{ return (void *)0xdeadbeaf; }
 #define _thread_mutex_destroy		_thread_empty
 #define _thread_mutex_lock		_thread_empty
 #define _thread_mutex_unlock		_thread_empty
+#define _thread_rwlock_init		_thread_empty
+#define _thread_rwlock_destroy		_thread_empty
+#define _thread_rwlock_rdlock		_thread_empty
+#define _thread_rwlock_tryrdlock(_a)	0
+#define _thread_rwlock_wrlock		_thread_empty
+#define _thread_rwlock_unlock		_thread_empty
 #define _thread_spin_init		_thread_empty
 #define _thread_spin_lock		_thread_empty
 #define _thread_spin_unlock		_thread_empty